@@ -0,0 +1,79 @@
+#ifndef __alarm_h
+#define __alarm_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The "alarm" structure now contains the absolute deadline of
+ * each alarm (a CLOCK_MONOTONIC reading in nanoseconds, see
+ * alarm_time.h), so that they can be sorted. Storing the
+ * requested interval would not be enough, since the "alarm
+ * thread" cannot tell how long it has been on the list.
+ *
+ * The "link", "back" and "queue_slot" members belong to whichever
+ * pending-alarm queue the program was built with (see
+ * alarm_queue.h); nothing else should touch them while the alarm
+ * is queued.
+ *
+ * An alarm_t also carries a command from main to a shard's alarm
+ * thread (see shard_submit); "op" says which. ALARM_SET queues the
+ * alarm, or replaces the pending alarm with the same
+ * Message_Number; ALARM_CANCEL cancels the pending alarm with its
+ * Message_Number.
+ *
+ * An alarm_t holds only what the alarm threads look at while
+ * scheduling, and fits in one 64-byte cache line. Everything that
+ * is only needed to acknowledge or deliver the alarm is in its
+ * "body", which comes from the arena (see alarm_arena.h) and is as
+ * long as its message, so messages have no length limit and a
+ * walk over a queue does not drag them through the cache. The body
+ * belongs to the alarm: alarm_alloc allocates it and alarm_free
+ * frees it.
+ *
+ * The body's "client" says where the command came from, and so
+ * where its acknowledgement and the alarm's expiry go (see
+ * alarm_server.h); 0 is standard input and output.
+ *
+ * An alarm may fire anywhere from its "deadline" (in the body) to
+ * "slack" after it. "time", the moment it is actually queued for,
+ * is picked in that window by deadline_slack (see alarm_time.h),
+ * so that alarms whose windows overlap tend to share one wakeup.
+ * Without slack, "time" is the deadline.
+ *
+ * An alarm with a "period" is re-armed in place every time it
+ * fires, at "time" + "period", so it never drifts. The same alarm_t
+ * may then be both in the queue and on its way to a dispatcher:
+ * "batch" chains it into the batch of expired alarms instead of
+ * "link", the body's "fired" keeps the deadline being delivered,
+ * and "refs" counts the holders (the queue, and an undelivered
+ * firing). The last to let go frees it (see alarm_release).
+ * alarm_alloc sets "refs" to 1.
+ */
+#define ALARM_SET       0
+#define ALARM_CANCEL    1
+
+typedef struct alarm_body_tag {
+    int64_t             interval;       /* requested delay, nsec */
+    int64_t             deadline;       /* monotonic, nsec */
+    int64_t             slack;          /* may fire this much later */
+    int64_t             fired;          /* deadline being delivered */
+    int                 client;         /* 0, or a socket client */
+    int                 length;         /* of "message" */
+    char                message[];      /* NUL-terminated */
+} alarm_body_t;
+
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    struct alarm_tag    **back;         /* pointer that points at us */
+    int64_t             time;           /* when it is due to fire */
+    int64_t             period;         /* 0, or nsec between firings */
+    struct alarm_tag    *batch;         /* next expired alarm */
+    alarm_body_t        *body;
+    int                 queue_slot;     /* queue's private bookkeeping */
+    int                 Message_Number;
+    int                 refs;
+    int                 op;             /* ALARM_SET or ALARM_CANCEL */
+} alarm_t;
+
+#endif
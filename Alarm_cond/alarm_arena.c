@@ -0,0 +1,267 @@
+/*
+ * alarm_arena.c
+ *
+ * Size-class arena for alarm bodies.
+ *
+ * Each thread bump-allocates bodies out of its own ARENA_CHUNK
+ * block, and keeps a free list ("shelf") per size class. A freed
+ * body goes on the shelf of the thread that frees it. A shelf that
+ * grows to twice ARENA_BATCH hands ARENA_BATCH bodies to the
+ * class's depot in one acquisition of arena_mutex, and an empty
+ * shelf takes a whole batch back from the depot before it bumps a
+ * new body. Bodies are created by the command front end and freed
+ * by the dispatchers, so they flow through the depot much as
+ * alarms flow through the pool's slabs (see alarm_pool.c).
+ *
+ * The depot is peeked at without the mutex; the peek is only a
+ * hint, and the batch is taken under it.
+ *
+ * Chunks are never given back to the system, nor is the unused
+ * tail of a chunk that could not fit the next body, or of an
+ * exited thread's chunk.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "alarm_arena.h"
+#include "errors.h"
+
+#define ARENA_ALIGN     16
+#define ARENA_CLASSES   32              /* bodies up to 512 bytes */
+#define ARENA_CHUNK     (1024 * 1024)
+#define ARENA_BATCH     64
+
+#define BODY_SIZE(length)       (sizeof (alarm_body_t) + (length) + 1)
+#define BODY_CLASS(size)        (((size) - 1) / ARENA_ALIGN)
+#define CLASS_SIZE(class)       (((size_t)(class) + 1) * ARENA_ALIGN)
+
+/*
+ * A free body. The first body of a batch in the depot also carries
+ * the next batch and its own length.
+ */
+typedef struct free_tag {
+    struct free_tag     *next;
+    struct free_tag     *batch;
+    long                count;
+} free_t;
+
+typedef struct shelf_tag {
+    free_t              *list;
+    long                count;
+} shelf_t;
+
+typedef struct arena_cache_tag {
+    struct arena_cache_tag *next;       /* on arena_caches list */
+    struct arena_cache_tag **back;
+    long                allocated;      /* bytes */
+    long                freed;
+    int                 registered;     /* only the owner looks */
+    char                *bump;
+    char                *limit;
+    shelf_t             shelf[ARENA_CLASSES];
+} arena_cache_t;
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static free_t *arena_depot[ARENA_CLASSES];
+static long arena_chunks = 0;
+static long arena_large = 0;            /* bytes of large bodies */
+static arena_cache_t *arena_caches = NULL;
+static long arena_allocated = 0;        /* totals of exited threads */
+static long arena_freed = 0;
+
+static __thread arena_cache_t arena_cache;
+
+static void arena_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&arena_mutex);
+    if (status != 0)
+        err_abort (status, "Lock arena");
+}
+
+static void arena_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&arena_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock arena");
+}
+
+/*
+ * Move the first "count" bodies of a shelf to the depot.
+ */
+static void shelf_flush (shelf_t *shelf, int class, long count)
+{
+    free_t *first, *last;
+    long i;
+
+    first = last = shelf->list;
+    for (i = 1; i < count; i++)
+        last = last->next;
+    shelf->list = last->next;
+    shelf->count -= count;
+    last->next = NULL;
+    first->count = count;
+    arena_lock ();
+    first->batch = arena_depot[class];
+    __atomic_store_n (&arena_depot[class], first, __ATOMIC_RELAXED);
+    arena_unlock ();
+}
+
+/*
+ * Fill an empty shelf with a batch from the depot or, failing
+ * that, with one body from the thread's chunk.
+ */
+static void shelf_refill (arena_cache_t *cache, int class)
+{
+    shelf_t *shelf = &cache->shelf[class];
+    free_t *batch = NULL;
+    size_t size = CLASS_SIZE (class);
+
+    if (__atomic_load_n (&arena_depot[class], __ATOMIC_RELAXED) != NULL) {
+        arena_lock ();
+        batch = arena_depot[class];
+        if (batch != NULL)
+            __atomic_store_n (&arena_depot[class], batch->batch, __ATOMIC_RELAXED);
+        arena_unlock ();
+    }
+    if (batch != NULL) {
+        shelf->list = batch;
+        shelf->count = batch->count;
+        return;
+    }
+    if (cache->limit - cache->bump < (ptrdiff_t)size) {
+        cache->bump = (char*)malloc (ARENA_CHUNK);
+        if (cache->bump == NULL)
+            errno_abort ("Allocate arena chunk");
+        cache->limit = cache->bump + ARENA_CHUNK;
+        __atomic_add_fetch (&arena_chunks, 1, __ATOMIC_RELAXED);
+    }
+    shelf->list = (free_t*)cache->bump;
+    shelf->list->next = NULL;
+    shelf->count = 1;
+    cache->bump += size;
+}
+
+/*
+ * Called as a thread exits, with its cache.
+ */
+static void cache_destroy (void *arg)
+{
+    arena_cache_t *cache = (arena_cache_t*)arg;
+    int class;
+
+    for (class = 0; class < ARENA_CLASSES; class++)
+        if (cache->shelf[class].count > 0)
+            shelf_flush (&cache->shelf[class], class, cache->shelf[class].count);
+    arena_lock ();
+    *cache->back = cache->next;
+    if (cache->next != NULL)
+        cache->next->back = cache->back;
+    arena_allocated += cache->allocated;
+    arena_freed += cache->freed;
+    arena_unlock ();
+}
+
+static void arena_init (void)
+{
+    int status;
+
+    status = pthread_key_create (&arena_key, cache_destroy);
+    if (status != 0)
+        err_abort (status, "Create arena key");
+}
+
+static void cache_register (arena_cache_t *cache)
+{
+    int status;
+
+    status = pthread_once (&arena_once, arena_init);
+    if (status != 0)
+        err_abort (status, "Init arena");
+    status = pthread_setspecific (arena_key, cache);
+    if (status != 0)
+        err_abort (status, "Set arena key");
+    arena_lock ();
+    cache->next = arena_caches;
+    if (cache->next != NULL)
+        cache->next->back = &cache->next;
+    cache->back = &arena_caches;
+    arena_caches = cache;
+    cache->registered = 1;
+    arena_unlock ();
+}
+
+alarm_body_t *body_alloc (size_t length)
+{
+    arena_cache_t *cache = &arena_cache;
+    alarm_body_t *body;
+    shelf_t *shelf;
+    size_t size = BODY_SIZE (length);
+    int class = BODY_CLASS (size);
+
+    if (!cache->registered)
+        cache_register (cache);
+    if (class >= ARENA_CLASSES) {
+        body = (alarm_body_t*)malloc (size);
+        if (body == NULL)
+            errno_abort ("Allocate alarm body");
+        __atomic_add_fetch (&arena_large, size, __ATOMIC_RELAXED);
+    } else {
+        size = CLASS_SIZE (class);
+        shelf = &cache->shelf[class];
+        if (shelf->list == NULL)
+            shelf_refill (cache, class);
+        body = (alarm_body_t*)shelf->list;
+        shelf->list = shelf->list->next;
+        shelf->count--;
+    }
+    __atomic_store_n (&cache->allocated, cache->allocated + size, __ATOMIC_RELAXED);
+    body->length = length;
+    return body;
+}
+
+void body_free (alarm_body_t *body)
+{
+    arena_cache_t *cache = &arena_cache;
+    free_t *item = (free_t*)body;
+    shelf_t *shelf;
+    size_t size = BODY_SIZE (body->length);
+    int class = BODY_CLASS (size);
+
+    if (!cache->registered)
+        cache_register (cache);
+    if (class >= ARENA_CLASSES) {
+        __atomic_sub_fetch (&arena_large, size, __ATOMIC_RELAXED);
+        free (body);
+    } else {
+        size = CLASS_SIZE (class);
+        shelf = &cache->shelf[class];
+        item->next = shelf->list;
+        shelf->list = item;
+        if (++shelf->count == 2 * ARENA_BATCH)
+            shelf_flush (shelf, class, ARENA_BATCH);
+    }
+    __atomic_store_n (&cache->freed, cache->freed + size, __ATOMIC_RELAXED);
+}
+
+void arena_stats (arena_stats_t *stats)
+{
+    arena_cache_t *cache;
+    long allocated, freed;
+
+    arena_lock ();
+    allocated = arena_allocated;
+    freed = arena_freed;
+    for (cache = arena_caches; cache != NULL; cache = cache->next) {
+        allocated += __atomic_load_n (&cache->allocated, __ATOMIC_RELAXED);
+        freed += __atomic_load_n (&cache->freed, __ATOMIC_RELAXED);
+    }
+    arena_unlock ();
+    stats->chunks = __atomic_load_n (&arena_chunks, __ATOMIC_RELAXED) * ARENA_CHUNK;
+    stats->large = __atomic_load_n (&arena_large, __ATOMIC_RELAXED);
+    stats->in_use = allocated - freed;
+}
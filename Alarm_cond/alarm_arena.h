@@ -0,0 +1,35 @@
+#ifndef __alarm_arena_h
+#define __alarm_arena_h
+
+#include <stddef.h>
+#include "alarm.h"
+
+/*
+ * The store for alarm bodies (see alarm.h), which vary in length
+ * with their message. Bodies are bump-allocated out of large
+ * chunks, in size classes of ARENA_ALIGN bytes, and a freed body
+ * goes on its thread's free list for its class, to be handed out
+ * again for the next body of that size. Bodies too large for any
+ * class come from malloc.
+ *
+ * Like the pool, the arena does its own locking, and any thread
+ * may free a body that another thread allocated.
+ */
+alarm_body_t *body_alloc (size_t length);
+void body_free (alarm_body_t *body);
+
+/*
+ * Arena occupancy, in bytes. "chunks" and "large" are what has
+ * been taken from malloc for chunks and for bodies too large for
+ * a chunk; "in_use" is what live bodies take up, rounded up to
+ * their size class.
+ */
+typedef struct arena_stats_tag {
+    long                chunks;
+    long                large;
+    long                in_use;
+} arena_stats_t;
+
+void arena_stats (arena_stats_t *stats);
+
+#endif
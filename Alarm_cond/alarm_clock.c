@@ -0,0 +1,319 @@
+/*
+ * alarm_clock.c
+ *
+ * The real and virtual clocks (see alarm_clock.h), each a
+ * clock_class_t; clock_select points "clock_class" at one of them.
+ *
+ * The virtual clock's state is protected by clock_mutex, apart
+ * from its reading, "clock_time", which is read atomically by
+ * anyone and only stored with clock_mutex held. "clock_holds"
+ * counts the holds. Whoever drops it to 0 -- clock_release, or an
+ * alarm thread going to wait -- moves the time on (clock_advance):
+ * to the earliest deadline waited for, if that is within the
+ * limit, marking the threads waiting for it "woken" and taking a
+ * hold for each of them. If there is nothing to move on to, the
+ * clock has settled.
+ *
+ * A waiting alarm thread sleeps on its engine with no deadline.
+ * Woken threads are woken through their engines (clock_kick), which
+ * locks their shards' mutexes, so it is done with clock_mutex
+ * released (an alarm thread locks clock_mutex with its shard's
+ * mutex held), and by an alarm thread only with its own shard's
+ * mutex released. A wake for a thread that is not waiting
+ * (clock_wake from shard_submit) is kept, and ends its next wait at
+ * once, so none is lost.
+ */
+#include <errno.h>
+#include <string.h>
+#include "alarm_clock.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+typedef struct clock_class_tag {
+    const char          *name;
+    int                 (*wait) (clock_waiter_t *waiter, int64_t deadline);
+    void                (*wake) (clock_waiter_t *waiter);
+    void                (*hold) (long count);
+    void                (*release) (long count);
+    void                (*settle) (void);
+} clock_class_t;
+
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clock_settled = PTHREAD_COND_INITIALIZER;
+static int64_t clock_time;
+static int64_t clock_offset;            /* wall clock - clock_time */
+static int64_t clock_limit = INT64_MAX;
+static long clock_holds;
+static clock_waiter_t *clock_waiters = NULL;
+
+static int real_wait (clock_waiter_t *waiter, int64_t deadline)
+{
+    return engine_wait (waiter->engine, waiter->mutex, deadline);
+}
+
+static void real_wake (clock_waiter_t *waiter)
+{
+    engine_wake (waiter->engine, waiter->mutex);
+}
+
+static void real_count (long count)
+{
+}
+
+static void real_settle (void)
+{
+}
+
+static const clock_class_t real_clock = {
+    "real", real_wait, real_wake, real_count, real_count, real_settle
+};
+
+static void clock_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&clock_mutex);
+    if (status != 0)
+        err_abort (status, "Lock clock mutex");
+}
+
+static void clock_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&clock_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock clock mutex");
+}
+
+static int64_t virtual_now (void)
+{
+    return __atomic_load_n (&clock_time, __ATOMIC_ACQUIRE);
+}
+
+static int64_t virtual_wall (void)
+{
+    return virtual_now () + clock_offset;
+}
+
+/*
+ * The earliest deadline still waited for. Called with clock_mutex
+ * locked.
+ */
+static int64_t clock_next (void)
+{
+    clock_waiter_t *waiter;
+    int64_t next = INT64_MAX;
+
+    for (waiter = clock_waiters; waiter != NULL; waiter = waiter->next)
+        if (waiter->waiting && !waiter->woken && waiter->deadline < next)
+            next = waiter->deadline;
+    return next;
+}
+
+/*
+ * Move the time on if nothing holds the clock. Called with
+ * clock_mutex locked; returns the number of threads woken, which
+ * must then be kicked.
+ */
+static int clock_advance (void)
+{
+    clock_waiter_t *waiter;
+    int64_t next;
+    int woken = 0;
+
+    if (clock_holds > 0)
+        return 0;
+    next = clock_next ();
+    if (next == INT64_MAX || next > clock_limit) {
+        pthread_cond_broadcast (&clock_settled);
+        return 0;
+    }
+    if (next > clock_time)
+        __atomic_store_n (&clock_time, next, __ATOMIC_RELEASE);
+    for (waiter = clock_waiters; waiter != NULL; waiter = waiter->next)
+        if (waiter->waiting && !waiter->woken && waiter->deadline <= next) {
+            waiter->woken = 1;
+            __atomic_store_n (&waiter->kick, 1, __ATOMIC_RELEASE);
+            clock_holds++;
+            woken++;
+        }
+    return woken;
+}
+
+/*
+ * Wake, through its engine, every woken thread that has not been
+ * yet. Called without clock_mutex. The list of waiters is complete
+ * before any of them waits.
+ */
+static void clock_kick (void)
+{
+    clock_waiter_t *waiter;
+
+    for (waiter = __atomic_load_n (&clock_waiters, __ATOMIC_ACQUIRE);
+            waiter != NULL; waiter = waiter->next)
+        if (__atomic_exchange_n (&waiter->kick, 0, __ATOMIC_ACQ_REL))
+            engine_wake (waiter->engine, waiter->mutex);
+}
+
+/*
+ * A thread that is woken keeps the hold taken for it; one that
+ * returns from its engine early (a spurious wakeup) takes its own.
+ * A wake kept from while it was not waiting ends the wait before
+ * it starts, and costs no hold.
+ */
+static int virtual_wait (clock_waiter_t *waiter, int64_t deadline)
+{
+    int status;
+
+    clock_lock ();
+    if (waiter->woken)
+        waiter->woken = 0;
+    else if (clock_time < deadline) {
+        waiter->deadline = deadline;
+        waiter->waiting = 1;
+        clock_holds--;
+        if (clock_advance () > 0) {
+            if (waiter->woken)          /* no need to wake itself */
+                __atomic_store_n (&waiter->kick, 0, __ATOMIC_RELEASE);
+            clock_unlock ();
+            status = pthread_mutex_unlock (waiter->mutex);
+            if (status != 0)
+                err_abort (status, "Unlock shard");
+            clock_kick ();
+            status = pthread_mutex_lock (waiter->mutex);
+            if (status != 0)
+                err_abort (status, "Lock shard");
+            clock_lock ();
+        }
+
+        /*
+         * From here the shard's mutex is held until engine_wait
+         * releases it, so a kick cannot come in between.
+         */
+        if (!waiter->woken) {
+            clock_unlock ();
+            engine_wait (waiter->engine, waiter->mutex, INT64_MAX);
+            clock_lock ();
+        }
+        if (waiter->woken)
+            waiter->woken = 0;
+        else
+            clock_holds++;
+        waiter->waiting = 0;
+    }
+    status = clock_time >= deadline ? ETIMEDOUT : 0;
+    clock_unlock ();
+    return status;
+}
+
+static void virtual_wake (clock_waiter_t *waiter)
+{
+    clock_lock ();
+    if (!waiter->woken) {
+        waiter->woken = 1;
+        if (waiter->waiting) {
+            __atomic_store_n (&waiter->kick, 1, __ATOMIC_RELEASE);
+            clock_holds++;
+        }
+    }
+    clock_unlock ();
+    clock_kick ();
+}
+
+static void virtual_hold (long count)
+{
+    clock_lock ();
+    clock_holds += count;
+    clock_unlock ();
+}
+
+static void virtual_release (long count)
+{
+    clock_lock ();
+    clock_holds -= count;
+    clock_advance ();
+    clock_unlock ();
+    clock_kick ();
+}
+
+static void virtual_settle (void)
+{
+    int64_t next;
+    int status;
+
+    virtual_release (1);
+    clock_lock ();
+    while (1) {
+        next = clock_next ();
+        if (clock_holds == 0 && (next == INT64_MAX || next > clock_limit))
+            break;
+        status = pthread_cond_wait (&clock_settled, &clock_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on clock");
+    }
+    clock_holds++;
+    clock_unlock ();
+}
+
+static const clock_class_t virtual_clock = {
+    "virtual", virtual_wait, virtual_wake, virtual_hold, virtual_release,
+    virtual_settle
+};
+
+static const clock_class_t *clock_class = &real_clock;
+
+int clock_select (const char *name, int64_t limit)
+{
+    if (strcmp (name, real_clock.name) == 0)
+        clock_class = &real_clock;
+    else if (strcmp (name, virtual_clock.name) == 0) {
+        clock_class = &virtual_clock;
+        clock_time = alarm_now ();
+        clock_offset = alarm_wall () - clock_time;
+        if (limit != 0)
+            clock_limit = clock_time + limit;
+        time_now = virtual_now;
+        time_wall = virtual_wall;
+    } else
+        return -1;
+    return 0;
+}
+
+void clock_join (clock_waiter_t *waiter, engine_t *engine,
+    pthread_mutex_t *mutex)
+{
+    memset (waiter, 0, sizeof (clock_waiter_t));
+    waiter->engine = engine;
+    waiter->mutex = mutex;
+    clock_lock ();
+    waiter->next = clock_waiters;
+    __atomic_store_n (&clock_waiters, waiter, __ATOMIC_RELEASE);
+    clock_holds++;
+    clock_unlock ();
+}
+
+int clock_wait (clock_waiter_t *waiter, int64_t deadline)
+{
+    return clock_class->wait (waiter, deadline);
+}
+
+void clock_wake (clock_waiter_t *waiter)
+{
+    clock_class->wake (waiter);
+}
+
+void clock_hold (long count)
+{
+    clock_class->hold (count);
+}
+
+void clock_release (long count)
+{
+    clock_class->release (count);
+}
+
+void clock_settle (void)
+{
+    clock_class->settle ();
+}
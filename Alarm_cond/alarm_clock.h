@@ -0,0 +1,81 @@
+#ifndef __alarm_clock_h
+#define __alarm_clock_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include "alarm_engine.h"
+
+/*
+ * The clock the alarms run on. Every reading of the time (see
+ * alarm_now in alarm_time.h) and every timed wait of an alarm
+ * thread (clock_wait) goes through the clock picked, once, with
+ * clock_select:
+ *
+ *      real            CLOCK_MONOTONIC and CLOCK_REALTIME, with the
+ *                      alarm threads sleeping on their timing
+ *                      engines (default)
+ *      virtual         starts at the real time, then stands still
+ *                      for as long as anything is going on. Once
+ *                      nothing is, it jumps straight to the
+ *                      earliest deadline an alarm thread is waiting
+ *                      for, and wakes the threads waiting for it.
+ *
+ * Under the virtual clock alarms fire in the order they would in
+ * real time, none of them late, but a schedule spanning days runs
+ * in the time it takes to process it.
+ *
+ * The virtual clock knows something is going on because whoever
+ * starts it holds the clock (clock_hold) until it is done
+ * (clock_release): main while it has input to read, each alarm
+ * thread while it is not waiting, each expired alarm until it is
+ * delivered, each command until it is durable and each query
+ * until it is answered. Under the real clock holds cost nothing.
+ */
+
+/*
+ * An alarm thread's place on the clock. Its fields are private to
+ * alarm_clock.c.
+ */
+typedef struct clock_waiter_tag {
+    struct clock_waiter_tag *next;
+    engine_t            *engine;
+    pthread_mutex_t     *mutex;
+    int64_t             deadline;
+    int                 waiting;
+    int                 woken;
+    int                 kick;           /* engine_wake still owed */
+} clock_waiter_t;
+
+/*
+ * Select the clock by name ("real" or "virtual"); "limit", if not
+ * 0, is how far the virtual clock may run from where it starts.
+ * Must be called before any thread reads the clock. Returns -1 if
+ * the name is unknown.
+ */
+int clock_select (const char *name, int64_t limit);
+
+/*
+ * Register an alarm thread, which waits with "mutex" locked on
+ * "engine". It holds the clock until its first wait.
+ */
+void clock_join (clock_waiter_t *waiter, engine_t *engine,
+    pthread_mutex_t *mutex);
+
+/*
+ * engine_wait and engine_wake (see alarm_engine.h), on the clock.
+ */
+int clock_wait (clock_waiter_t *waiter, int64_t deadline);
+void clock_wake (clock_waiter_t *waiter);
+
+void clock_hold (long count);
+void clock_release (long count);
+
+/*
+ * Called by main, which holds the clock, when it has no more
+ * input: under the virtual clock, let time run until nothing is
+ * left to fire before its limit, and everything has been
+ * delivered. Under the real clock, return at once.
+ */
+void clock_settle (void);
+
+#endif
@@ -8,207 +8,675 @@
  * corresponds to the earliest timer request. If the main thread
  * enters an earlier timeout, it signals the condition variable
  * so that the alarm thread will wake up and process the earlier
- * timeout first, requeueing the later request.
+ * timeout first.
+ *
+ * The engine is sharded (see alarm_shard.h): there are several
+ * alarm threads, each with its own mutex, condition variable and
+ * queue, and every alarm is routed to one of them by its
+ * Message_Number. This file is the command front end.
+ *
+ * Deadlines are CLOCK_MONOTONIC nanoseconds (see alarm_time.h),
+ * and the condition variable is set up to time its waits on the
+ * same clock, so alarms are not moved when the wall clock is set.
+ * How late they fire is bounded by the queue's tick (one
+ * millisecond with the timing wheel, see alarm_wheel.c), plus the
+ * time the alarm thread takes to be scheduled. Intervals may be
+ * given in seconds or with a unit: "250ms", "100us", "5s".
+ *
+ * Pending alarms are kept in a queue_t (see alarm_queue.h). By
+ * default that is a hierarchical timing wheel, so scheduling an
+ * alarm no longer costs a walk over every pending alarm. An index
+ * (see alarm_index.h) maps each Message_Number to its pending
+ * alarm, so that "Cancel: Message(n)" and entering a new alarm
+ * with the number of a pending one (which replaces it) are O(1)
+ * lookups.
+ *
+ * Alarms come from a slab pool (see alarm_pool.h) rather than
+ * malloc, and their messages, of any length, from an arena (see
+ * alarm_arena.h). A command line is parsed before any alarm is
+ * taken from it, so bad commands allocate nothing.
+ *
+ * "every 5 Message(n) text" sets a periodic alarm, which fires
+ * every 5 seconds until it is cancelled. It stays in its shard's
+ * queue and index and is re-armed in place each time it fires,
+ * at its previous deadline plus the period, so it does not drift.
+ *
+ * main never locks a shard. Each command goes to its shard's
+ * alarm thread through a lock-free queue (see shard_submit), and
+ * the alarm thread applies it and prints the "Replacing" or
+ * "Cancel" acknowledgement.
+ *
+ * The alarm threads do not print expired alarms themselves; they
+ * hand them to a pool of dispatcher threads (see
+ * alarm_dispatch.h), so slow output cannot delay the next
+ * deadline. Options:
+ *
+ *      -s, --shards=N          number of shards (default: online
+ *                              CPUs)
+ *      -w, --workers=N         number of dispatcher threads
+ *                              (default: one per shard)
+ *      -q, --capacity=N        size of each shard's hand-off queue
+ *                              (default 1024)
+ *      -r, --readers=N         number of threads answering List and
+ *                              Query (default 2, see alarm_query.h)
+ *      -b, --batch             read commands in bulk (see below)
+ *      -i, --interactive       prompt for commands one line at a
+ *                              time, even if input is not a terminal
+ *      --output-full=MODE      what a thread that finds the output
+ *                              ring full does: "block" (default),
+ *                              "drop" the line, or "count" the
+ *                              lines dropped into the output
+ *      --listen=PATH           take commands from clients of the
+ *                              Unix domain socket PATH instead of
+ *                              from standard input (see
+ *                              alarm_server.h), until SIGINT or
+ *                              SIGTERM
+ *      --snapshot=PATH         load the pending alarms saved in PATH
+ *                              at startup, and save them there at
+ *                              exit (see alarm_snapshot.h)
+ *      --journal=PATH          append every command to the journal
+ *                              PATH, and replay it at startup (see
+ *                              alarm_journal.h)
+ *      --journal-interval=DUR  longest a command waits to be synced
+ *                              (default 2ms)
+ *      --journal-bytes=N       sync as soon as N bytes are waiting
+ *                              (default 64KB)
+ *      --journal-compact=N     rewrite the journal when it is over N
+ *                              bytes and has doubled (default 16MB)
+ *      --stats-file=PATH       rewrite PATH with the runtime
+ *                              statistics, in the Prometheus text
+ *                              format, every --stats-interval
+ *      --stats-interval=DUR    how often (default 10s)
+ *      --slack=DUR             let alarms without a slack of their
+ *                              own ("10~2 Message(1) ...") fire up
+ *                              to DUR late, so that alarms close
+ *                              together share a wakeup (default 0)
+ *      --clock=CLOCK           "real" (default) or "virtual" time
+ *                              (see below and alarm_clock.h)
+ *      --until=DUR             stop a virtual clock DUR after the
+ *                              start
+ *
+ * In batch mode, the default when standard input is not a
+ * terminal, there are no prompts: input is read a megabyte at a
+ * time and the commands of each read are grouped by shard, so that
+ * each group is handed over with one push and at most one wakeup
+ * (see batch_read). The ingest rate is reported at the end.
+ *
+ * All output, from every thread, goes through the output ring
+ * (see alarm_output.h) and is written by its own thread, so a
+ * slow terminal or pipe stalls neither scheduling nor delivery.
+ *
+ * Every thread keeps counts of its own (see alarm_stats.h). The
+ * "Stats" command prints their sum, and the same summary goes to
+ * stderr when input ends.
+ *
+ * With --clock=virtual, time stands still while anything is going
+ * on and then jumps to the next deadline, so a schedule spanning
+ * days runs in seconds, firing in the same order as it would in
+ * real time. In batch mode it stands still until input ends, so
+ * the whole input is taken as entered at the start; it then runs
+ * until every alarm has fired (or until --until, which periodic
+ * alarms need), before the program exits. Interactively, and when
+ * listening, it runs whenever main is waiting for input.
  */
+#include <getopt.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "alarm.h"
+#include "alarm_shard.h"
+#include "alarm_time.h"
+#include "alarm_clock.h"
+#include "alarm_pool.h"
+#include "alarm_dispatch.h"
+#include "alarm_parse.h"
+#include "alarm_output.h"
+#include "alarm_stats.h"
+#include "alarm_snapshot.h"
+#include "alarm_journal.h"
+#include "alarm_server.h"
+#include "alarm_query.h"
+
+#define BATCH_BUFFER    (1024 * 1024)   /* bytes per read */
+#define GROUP_SIZE      256             /* commands per push */
+
+static const char *snapshot_file = NULL;
+static int64_t default_slack = 0;
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * The commands for one shard collected from a batch of input, in
+ * input order.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    int                 Message_Number;
-    int                 findMessage_number;
-    char                message[64];
-} alarm_t;
-
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+typedef struct group_tag {
+    alarm_t             *first;
+    alarm_t             *last;
+    int                 count;
+} group_t;
+
+static struct option long_options[] = {
+    {"shards",          required_argument,      NULL,   's'},
+    {"workers",         required_argument,      NULL,   'w'},
+    {"capacity",        required_argument,      NULL,   'q'},
+    {"readers",         required_argument,      NULL,   'r'},
+    {"batch",           no_argument,            NULL,   'b'},
+    {"interactive",     no_argument,            NULL,   'i'},
+    {"output-full",     required_argument,      NULL,   'o'},
+    {"listen",          required_argument,      NULL,   'l'},
+    {"snapshot",        required_argument,      NULL,   'n'},
+    {"journal",         required_argument,      NULL,   'j'},
+    {"journal-interval", required_argument,     NULL,   'J'},
+    {"journal-bytes",   required_argument,      NULL,   'B'},
+    {"journal-compact", required_argument,      NULL,   'C'},
+    {"stats-file",      required_argument,      NULL,   'f'},
+    {"stats-interval",  required_argument,      NULL,   't'},
+    {"slack",           required_argument,      NULL,   'S'},
+    {"clock",           required_argument,      NULL,   'c'},
+    {"until",           required_argument,      NULL,   'u'},
+    {NULL,              0,                      NULL,   0}
+};
+
+static void usage (char *program)
+{
+    fprintf (stderr, "Usage: %s [-s shards] [-w workers] [-q capacity] [-r readers]\n"
+        "       [--batch|--interactive] [--output-full=block|drop|count]\n"
+        "       [--listen=path] [--snapshot=path]\n"
+        "       [--journal=path] [--journal-interval=duration] [--journal-bytes=n]\n"
+        "       [--journal-compact=n] [--stats-file=path] [--stats-interval=duration]\n"
+        "       [--slack=duration] [--clock=real|virtual] [--until=duration]\n",
+        program);
+    exit (1);
+}
+
+/*
+ * The main function prints out this message when a user enters an
+ * alarm.
+ */
+static void command_ack (alarm_t *alarm)
+{
+    char interval[32], slack[40] = "";
+
+    duration_format (alarm->body->interval, interval, sizeof (interval));
+    if (alarm->body->slack != 0) {
+        slack[0] = '~';
+        duration_format (alarm->body->slack, slack + 1, sizeof (slack) - 1);
+    }
+    client_printf (alarm->body->client, STDOUT_FILENO, "Alarm Request Received at <%ld>:<%s%s%s %s>\n",
+        (long)alarm_time (), alarm->period != 0 ? "every " : "", interval, slack,
+        alarm->body->message);
+}
+
+static void group_flush (group_t *group, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (group[i].count == 0)
+            continue;
+        shard_submit (&shards[i], group[i].first, group[i].last);
+        group[i].count = 0;
+    }
+}
 
 /*
- * Insert alarm entry on list, in order.
+ * Parse one command line (without its newline) from "client" (0
+ * for standard input) and acknowledge it. Returns the command, as
+ * an alarm from the pool, or NULL if the line is blank or not a
+ * command. "group", if not NULL, holds the caller's commands not
+ * yet submitted to their shards.
  */
-void alarm_insert (alarm_t *alarm)
+static alarm_t *command_parse (int client, const char *line, group_t *group)
 {
-    int status;
-    alarm_t **last, *next;
+    command_t command;
+    alarm_t *alarm;
+    int64_t now = 0;
 
     /*
-     * LOCKING PROTOCOL:
-     * 
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
+     * Scan the line (see alarm_parse.h); an alarm is only taken
+     * from the pool once the line turns out to be a command.
      */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
-        if (next->time >= alarm->time) {
-            alarm->link = next;
-            *last = alarm;
+    switch (command_scan (line, &command)) {
+    case COMMAND_BLANK:
+        return NULL;
+    case COMMAND_STATS:
+        stats_report (client, STDOUT_FILENO);
+        return NULL;
+    case COMMAND_LIST:
+    case COMMAND_QUERY:
+        /*
+         * The answer must reflect every command read before this
+         * one: pass them on to their shards (the readers apply
+         * what waits there, see shard_sync) before asking.
+         */
+        if (journal_on)
+            journal_flush ();
+        else if (group != NULL)
+            group_flush (group, shard_count);
+        stats_count (STAT_QUERY, 1);
+        query_submit (client, command.verb, command.number);
+        return NULL;
+    case COMMAND_CANCEL:
+        stats_count (STAT_CANCEL, 1);
+        alarm = alarm_alloc (0);
+        alarm->op = ALARM_CANCEL;
+        alarm->Message_Number = command.number;
+        alarm->body->client = client;
+        alarm->body->message[0] = '\0';
+        return alarm;
+    case COMMAND_SET:
+        /*
+         * duration_parse only checks that the interval fits in 64
+         * bits; its deadline must fit too, below INT64_MAX (which
+         * means "never").
+         */
+        now = alarm_now ();
+        if (command.interval < INT64_MAX - now)
             break;
-        }
-        last = &next->link;
-        next = next->link;
+        /* fall through */
+    default:
+        //Print out "Bad Command" if wrong input format.
+        stats_count (STAT_BAD, 1);
+        client_printf (client, STDERR_FILENO, "Bad command\n");
+        return NULL;
     }
+
+    stats_count (STAT_SET, 1);
+    alarm = alarm_alloc (command.length);
+    alarm->op = ALARM_SET;
+    alarm->Message_Number = command.number;
+    alarm->period = command.period;
+    alarm->body->client = client;
+    alarm->body->interval = command.interval;
+    alarm->body->deadline = now + command.interval;
+    alarm->body->slack = command.slack >= 0 ? command.slack : default_slack;
+    alarm->time = deadline_slack (alarm->body->deadline, alarm->body->slack);
+    memcpy (alarm->body->message, command.text, command.length);
+    alarm->body->message[command.length] = '\0';
+
     /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
+     * With a journal, the request is only acknowledged once it is
+     * on disk (see command_durable).
      */
-    if (next == NULL) {
-        *last = alarm;
-        alarm->link = NULL;
+    if (!journal_on)
+        command_ack (alarm);
+    return alarm;
+}
+
+static void group_add (group_t *group, alarm_t *command)
+{
+    shard_t *shard = shard_for (command->Message_Number);
+    group_t *mine = &group[shard - shards];
+
+    if (mine->count++ == 0)
+        mine->first = command;
+    else
+        mine->last->link = command;
+    mine->last = command;
+    if (mine->count == GROUP_SIZE) {
+        shard_submit (shard, mine->first, mine->last);
+        mine->count = 0;
     }
-#ifdef DEBUG
-    printf ("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf ("%d(%d)[\"%s\"] ", next->time,
-            next->time - time (NULL), next->message);
-    printf ("]\n");
-#endif
-    /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
-     */
-    if (current_alarm == 0 || alarm->time < current_alarm) {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal (&alarm_cond);
-        if (status != 0)
-            err_abort (status, "Signal cond");
+}
+
+/*
+ * Journal the command, or group it for its shard.
+ */
+static void command_take (group_t *group, alarm_t *command)
+{
+    if (journal_on)
+        journal_submit (command, command);
+    else
+        group_add (group, command);
+}
+
+/*
+ * Called by the journal's flusher (see alarm_journal.h) with a
+ * group of commands that are now on disk: acknowledge them and
+ * pass them to their shards.
+ */
+static void command_durable (alarm_t *first, alarm_t *last)
+{
+    static group_t *group = NULL;
+    alarm_t *command, *next;
+
+    if (group == NULL) {
+        group = (group_t*)calloc (shard_count, sizeof (group_t));
+        if (group == NULL)
+            errno_abort ("Allocate journal groups");
+    }
+    for (command = first; command != NULL; command = next) {
+        next = command == last ? NULL : command->link;
+        if (command->op == ALARM_SET)
+            command_ack (command);
+        group_add (group, command);
     }
+    group_flush (group, shard_count);
 }
 
 /*
- * The alarm thread's start routine.
+ * The commands read by the socket server in one round, grouped by
+ * shard (see server_run).
  */
-void *alarm_thread (void *arg)
+static group_t *server_group;
+
+static void server_command (int client, const char *line)
 {
-    alarm_t *alarm;
-    struct timespec cond_time;
-    time_t now;
-    int status, expired;
+    alarm_t *command;
 
-    /*
-     * Loop forever, processing commands. The alarm thread will
-     * be disintegrated when the process exits. Lock the mutex
-     * at the start -- it will be unlocked during condition
-     * waits, so the main thread can insert alarms.
-     */
-    status = pthread_mutex_lock (&alarm_mutex);
-    if (status != 0)
-        err_abort (status, "Lock mutex");
+    if ((command = command_parse (client, line, server_group)) != NULL)
+        command_take (server_group, command);
+}
+
+static void server_flush (void)
+{
+    group_flush (server_group, shard_count);
+}
+
+/*
+ * Read commands from standard input until end of file, a buffer
+ * at a time, without prompting. The commands of each buffer are
+ * submitted to their shards in groups rather than one by one (or,
+ * with a journal, to the journal, which groups them itself). A
+ * line too long for the buffer is a bad command.
+ */
+static void batch_read (void)
+{
+    group_t *group;
+    alarm_t *command;
+    char *buffer, *line, *end, *newline;
+    size_t held = 0;
+    ssize_t got;
+    long lines = 0, commands = 0;
+    int64_t start, elapsed;
+    int skipping = 0;
+
+    buffer = (char*)malloc (BATCH_BUFFER + 1);
+    group = (group_t*)calloc (shard_count, sizeof (group_t));
+    if (buffer == NULL || group == NULL)
+        errno_abort ("Allocate batch");
+    start = real_now ();
     while (1) {
-        /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
-         */
-        current_alarm = 0;
-        while (alarm_list == NULL) {
-            status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Wait on cond");
-            }
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-        now = time (NULL);
-        expired = 0;
-        if (alarm->time > now) {
-#ifdef DEBUG
-            printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                alarm->time - time (NULL), alarm->message);
-#endif
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-            while (current_alarm == alarm->time) {
-                status = pthread_cond_timedwait (
-                    &alarm_cond, &alarm_mutex, &cond_time);
-                if (status == ETIMEDOUT) {
-                    expired = 1;
-                    break;
+        got = read (0, buffer + held, BATCH_BUFFER - held);
+        if (got == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Read commands");
+        }
+        if (got == 0) {
+            /*
+             * A last line without a newline.
+             */
+            if (held > 0 && !skipping) {
+                buffer[held] = '\0';
+                lines++;
+                if ((command = command_parse (0, buffer, group)) != NULL) {
+                    command_take (group, command);
+                    commands++;
                 }
-                if (status != 0)
-                    err_abort (status, "Cond timedwait");
             }
-            if (!expired)
-                alarm_insert (alarm);
-        } else
-            expired = 1;
-        if (expired) {
-            printf ("%d Message(%d) %s\n", alarm->seconds, alarm->Message_Number, alarm->message);
-            free (alarm);
+            break;
+        }
+        held += got;
+        end = buffer + held;
+        line = buffer;
+        while ((newline = memchr (line, '\n', end - line)) != NULL) {
+            *newline = '\0';
+            lines++;
+            if (skipping)
+                skipping = 0;
+            else if ((command = command_parse (0, line, group)) != NULL) {
+                command_take (group, command);
+                commands++;
+            }
+            line = newline + 1;
         }
+        held = end - line;
+        if (held == BATCH_BUFFER) {
+            if (!skipping) {
+                stats_count (STAT_BAD, 1);
+                output_printf (STDERR_FILENO, "Bad command\n");
+            }
+            skipping = 1;
+            held = 0;
+        } else
+            memmove (buffer, line, held);
+        group_flush (group, shard_count);
     }
+    group_flush (group, shard_count);
+    elapsed = real_now () - start;
+    output_flush ();
+    fprintf (stderr, "Ingested %ld commands from %ld lines in %.3fs (%.0f commands/s)\n",
+        commands, lines, (double)elapsed / NSEC_PER_SEC,
+        elapsed > 0 ? (double)commands * NSEC_PER_SEC / elapsed : 0.0);
+    free (buffer);
+    free (group);
+}
+
+/*
+ * Input has ended: let the output catch up, print the summaries
+ * and leave.
+ */
+static void alarm_exit (void)
+{
+    long saved;
+    int i;
+
+    journal_flush ();
+    query_flush ();
+
+    /*
+     * The shards stay locked, so no alarm expires (or is printed)
+     * after it has gone into the snapshot.
+     */
+    if (snapshot_file != NULL) {
+        for (i = 0; i < shard_count; i++)
+            shard_lock (&shards[i]);
+        saved = snapshot_save (snapshot_file);
+        if (saved == -1)
+            output_printf (STDERR_FILENO, "Cannot save %s: %s\n", snapshot_file, strerror (errno));
+        else
+            output_printf (STDERR_FILENO, "Saved %ld alarms to %s\n", saved, snapshot_file);
+    }
+    stats_report (0, STDERR_FILENO);
+    output_flush ();
+    dispatch_report (stderr);
+    output_report (stderr);
+    exit (0);
 }
 
 int main (int argc, char *argv[])
 {
-    int status;
-    char line[128];
-    alarm_t *alarm;
-    pthread_t thread;
+    int option, batch, full = OUTPUT_BLOCK;
+    int shard_total = 0, workers = 0, capacity = 1024, readers = 2;
+    char *line = NULL;
+    const char *end, *stats_file = NULL, *journal_file = NULL;
+    const char *listen_path = NULL, *clock_name = "real";
+    long loaded, overdue, journal_bytes = 64 * 1024;
+    long journal_compact = 16 * 1024 * 1024;
+    int64_t journal_interval = 2 * NSEC_PER_MSEC;
+    int64_t stats_interval = 10 * NSEC_PER_SEC, start, until = 0;
+    size_t room = 0;
+    ssize_t length;
+    alarm_t *command;
 
-    status = pthread_create (
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
-    while (1) {
-        printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
-        if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
+    batch = !isatty (0);
+    while ((option = getopt_long (argc, argv, "s:w:q:r:bi", long_options, NULL)) != -1) {
+        switch (option) {
+        case 's':
+            shard_total = atoi (optarg);
+            if (shard_total < 1)
+                usage (argv[0]);
+            break;
+        case 'w':
+            workers = atoi (optarg);
+            if (workers < 1)
+                usage (argv[0]);
+            break;
+        case 'r':
+            readers = atoi (optarg);
+            if (readers < 1)
+                usage (argv[0]);
+            break;
+        case 'q':
+            capacity = atoi (optarg);
+            if (capacity < 1)
+                usage (argv[0]);
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'i':
+            batch = 0;
+            break;
+        case 'o':
+            if (strcmp (optarg, "block") == 0)
+                full = OUTPUT_BLOCK;
+            else if (strcmp (optarg, "drop") == 0)
+                full = OUTPUT_DROP;
+            else if (strcmp (optarg, "count") == 0)
+                full = OUTPUT_COUNT;
+            else
+                usage (argv[0]);
+            break;
+        case 'n':
+            snapshot_file = optarg;
+            break;
+        case 'j':
+            journal_file = optarg;
+            break;
+        case 'J':
+            end = duration_parse (optarg, &journal_interval);
+            if (end == NULL || *end != '\0')
+                usage (argv[0]);
+            break;
+        case 'B':
+            journal_bytes = atol (optarg);
+            if (journal_bytes < 1)
+                usage (argv[0]);
+            break;
+        case 'C':
+            journal_compact = atol (optarg);
+            if (journal_compact < 0)
+                usage (argv[0]);
+            break;
+        case 'l':
+            listen_path = optarg;
+            break;
+        case 'f':
+            stats_file = optarg;
+            break;
+        case 't':
+            end = duration_parse (optarg, &stats_interval);
+            if (end == NULL || *end != '\0' || stats_interval <= 0)
+                usage (argv[0]);
+            break;
+        case 'S':
+            end = duration_parse (optarg, &default_slack);
+            if (end == NULL || *end != '\0')
+                usage (argv[0]);
+            break;
+        case 'c':
+            clock_name = optarg;
+            break;
+        case 'u':
+            end = duration_parse (optarg, &until);
+            if (end == NULL || *end != '\0' || until <= 0)
+                usage (argv[0]);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    /*
+     * The journal already rebuilds the pending alarms; loading a
+     * snapshot as well would set each of them twice.
+     */
+    if (snapshot_file != NULL && journal_file != NULL)
+        usage (argv[0]);
+    if (shard_total == 0)
+        shard_total = sysconf (_SC_NPROCESSORS_ONLN);
+    if (shard_total < 1)
+        shard_total = 1;
+    if (workers == 0)
+        workers = shard_total;
 
-        /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
-         */
-        if (sscanf (line, "%d Message(%d) %64[^\n]", 
-            &alarm->seconds, &alarm->Message_Number, alarm->message) < 3) {
-            //Read in the Cancel Command if the message isn't a set command
-            if(sscanf (line, "Cancel: Message(%d)", &alarm->findMessage_number) < 1)
-            {
-                //Print out "Bad Command" if wrong input format.
-                fprintf (stderr, "Bad command\n");
-                //Free the alarm thread.
-                free (alarm);
-            }
-            else{
-                printf("Looking for alarm\n");
-            }
-        }else {
-            printf("Making the alarm\n");
-            status = pthread_mutex_lock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Lock mutex");
-            alarm->time = time (NULL) + alarm->seconds;
+    /*
+     * Pick the clock before any thread reads it. main holds it
+     * for as long as it has input (see alarm_clock.h).
+     */
+    if (clock_select (clock_name, until) == -1)
+        usage (argv[0]);
+    clock_hold (1);
 
+    if (listen_path != NULL)
+        server_start (listen_path);
+    output_start (full);
+    stats_start (stats_file, stats_interval);
+    dispatch_start (shard_total, workers, capacity);
+    shard_start (shard_total);
+    query_start (readers);
+    if (snapshot_file != NULL) {
+        start = real_now ();
+        loaded = snapshot_load (snapshot_file, &overdue);
+        if (loaded == -1) {
             /*
-             * The main function prints out this message when a user enters an alarm. */
-            printf("Alarm Request Received at <%d>:<%d %s>\n", (alarm->time - alarm->seconds), alarm->seconds, alarm->message);
-            /*
-             * Insert the new alarm into the list of alarms,
-             * sorted by expiration time.
+             * Leave the file alone rather than overwrite it at
+             * exit with the alarms of this run only.
              */
-            alarm_insert (alarm);
-            status = pthread_mutex_unlock (&alarm_mutex);
-            if (status != 0)
-                err_abort (status, "Unlock mutex");
+            output_printf (STDERR_FILENO, "Cannot load %s: %s (it will not be saved)\n",
+                snapshot_file, strerror (errno));
+            snapshot_file = NULL;
+        } else if (loaded > 0)
+            output_printf (STDERR_FILENO, "Loaded %ld alarms (%ld overdue) from %s in %.3fs\n",
+                loaded, overdue, snapshot_file, (double)(real_now () - start) / NSEC_PER_SEC);
+    }
+    if (journal_file != NULL) {
+        start = real_now ();
+        loaded = journal_replay (journal_file, &overdue);
+        if (loaded == -1) {
+            output_flush ();
+            fprintf (stderr, "Cannot replay %s: %s\n", journal_file, strerror (errno));
+            exit (1);
         }
+        if (loaded > 0)
+            output_printf (STDERR_FILENO, "Replayed %ld alarms (%ld overdue) from %s in %.3fs\n",
+                loaded, overdue, journal_file, (double)(real_now () - start) / NSEC_PER_SEC);
+        journal_start (journal_file, journal_interval, journal_bytes,
+            journal_compact, command_durable);
+    }
+    if (listen_path != NULL) {
+        server_group = (group_t*)calloc (shard_count, sizeof (group_t));
+        if (server_group == NULL)
+            errno_abort ("Allocate server groups");
+        server_run (server_command, server_flush, alarm_exit);
+    }
+    if (batch) {
+        batch_read ();
+        clock_settle ();
+        alarm_exit ();
+    }
+    while (1) {
+        output_printf (STDOUT_FILENO, "Alarm> ");
+        clock_release (1);
+        length = getline (&line, &room, stdin);
+        clock_hold (1);
+        if (length == -1) {
+            clock_settle ();
+            alarm_exit ();
+        }
+        if (length > 0 && line[length - 1] == '\n')
+            line[length - 1] = '\0';
+        command = command_parse (0, line, NULL);
+        if (command == NULL)
+            continue;
+        if (journal_on) {
+            /*
+             * Wait for the acknowledgement, so that it comes out
+             * before the next prompt.
+             */
+            journal_submit (command, command);
+            journal_flush ();
+        } else
+            shard_submit (shard_for (command->Message_Number), command, command);
     }
 }
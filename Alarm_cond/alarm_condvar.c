@@ -0,0 +1,76 @@
+/*
+ * alarm_condvar.c
+ *
+ * The condition variable timing engine. The condition variable is
+ * set up to time its waits on CLOCK_MONOTONIC, the clock the
+ * deadlines are read from, and wakeups signal it with the mutex
+ * held, so that none falls between the waiter's last look at its
+ * state and its wait.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include "alarm_engine.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+struct engine_tag {
+    pthread_cond_t      cond;
+};
+
+engine_t *engine_create (void)
+{
+    pthread_condattr_t cond_attr;
+    engine_t *engine;
+    int status;
+
+    engine = (engine_t*)malloc (sizeof (engine_t));
+    if (engine == NULL)
+        errno_abort ("Allocate engine");
+    status = pthread_condattr_init (&cond_attr);
+    if (status != 0)
+        err_abort (status, "Init cond attr");
+    status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort (status, "Set cond clock");
+    status = pthread_cond_init (&engine->cond, &cond_attr);
+    if (status != 0)
+        err_abort (status, "Init cond");
+    pthread_condattr_destroy (&cond_attr);
+    return engine;
+}
+
+int engine_wait (engine_t *engine, pthread_mutex_t *mutex, int64_t deadline)
+{
+    struct timespec cond_time;
+    int status;
+
+    if (deadline == INT64_MAX) {
+        status = pthread_cond_wait (&engine->cond, mutex);
+        if (status != 0)
+            err_abort (status, "Wait on cond");
+        return 0;
+    }
+    if (deadline < 0)
+        deadline = 0;
+    cond_time.tv_sec = deadline / NSEC_PER_SEC;
+    cond_time.tv_nsec = deadline % NSEC_PER_SEC;
+    status = pthread_cond_timedwait (&engine->cond, mutex, &cond_time);
+    if (status != 0 && status != ETIMEDOUT)
+        err_abort (status, "Cond timedwait");
+    return status;
+}
+
+void engine_wake (engine_t *engine, pthread_mutex_t *mutex)
+{
+    int status;
+
+    status = pthread_mutex_lock (mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    status = pthread_cond_signal (&engine->cond);
+    if (status != 0)
+        err_abort (status, "Signal cond");
+    status = pthread_mutex_unlock (mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
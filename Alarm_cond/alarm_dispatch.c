@@ -0,0 +1,348 @@
+/*
+ * alarm_dispatch.c
+ *
+ * The dispatcher pool. Each shard's ring of expired alarms is
+ * protected by its own mutex, with one condition variable for
+ * "not empty" (the ring's home dispatchers wait on it) and one for
+ * "not full" (the shard's alarm thread waits on it).
+ *
+ * Work stealing: a dispatcher whose home ring is empty tries the
+ * other rings, with pthread_mutex_trylock so that it never waits
+ * behind a busy ring, and takes half of the first backlog it
+ * finds (up to STEAL_BATCH alarms). When an alarm thread leaves a
+ * backlog in its ring, or finds it full, and none of the ring's
+ * own dispatchers is idle (there may be none: with fewer
+ * dispatchers than rings, some rings are only ever stolen from),
+ * it raises a "hint" on another ring that has an idle dispatcher
+ * and wakes it, so that it comes stealing. The
+ * unlocked peeks at other rings' "count" and "idle" are only
+ * hints; the decision is always re-made under the ring's mutex.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "alarm_dispatch.h"
+#include "alarm_server.h"
+#include "alarm_pool.h"
+#include "alarm_stats.h"
+#include "alarm_time.h"
+#include "alarm_clock.h"
+#include "errors.h"
+
+#define STEAL_BATCH     32
+
+typedef struct ring_tag {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      ready;
+    pthread_cond_t      space;
+    alarm_t             **slot;
+    int                 head;
+    int                 count;
+    int                 idle;           /* dispatchers waiting */
+    int                 hint;           /* come and steal */
+    int                 victim;         /* next ring to hint */
+    int                 high_water;
+} __attribute__ ((aligned (64))) ring_t;
+
+static ring_t *dispatch_rings;
+static int dispatch_ring_count;
+static int dispatch_capacity;
+static int dispatch_workers;
+
+static void ring_lock (ring_t *ring)
+{
+    int status;
+
+    status = pthread_mutex_lock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Lock dispatch");
+}
+
+static void ring_unlock (ring_t *ring)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&ring->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock dispatch");
+}
+
+/*
+ * Deliver one alarm, to standard output or to the client that set
+ * it. This runs without any lock held, and the line goes to the
+ * output ring (see alarm_output.h), so a slow reader of the output
+ * does not hold up the dispatchers.
+ */
+static void dispatch_deliver (alarm_t *alarm)
+{
+    char interval[32];
+
+    duration_format (alarm->body->interval, interval, sizeof (interval));
+    client_printf (alarm->body->client, STDOUT_FILENO, "%s Message(%d) %s\n", interval, alarm->Message_Number, alarm->body->message);
+    alarm_release (alarm);
+    clock_release (1);
+}
+
+/*
+ * Take the oldest alarm off a ring and record its lateness.
+ * The caller must have locked the ring, and the ring must not be
+ * empty.
+ */
+static alarm_t *ring_take (ring_t *ring, int64_t now)
+{
+    alarm_t *alarm;
+    int status;
+
+    alarm = ring->slot[ring->head];
+    ring->head = (ring->head + 1) % dispatch_capacity;
+    if (ring->count-- == dispatch_capacity) {
+        status = pthread_cond_signal (&ring->space);
+        if (status != 0)
+            err_abort (status, "Signal dispatch space");
+    }
+    stats_count (STAT_DELIVERED, 1);
+    stats_record (HIST_LATENESS, now - alarm->body->fired);
+    return alarm;
+}
+
+/*
+ * Look for a backlog on any ring but "home" and deliver half of
+ * it. Returns the number of alarms delivered.
+ */
+static int dispatch_steal (int home)
+{
+    alarm_t *batch[STEAL_BATCH];
+    ring_t *victim;
+    int64_t now;
+    int i, j, count, taken;
+
+    for (i = 1; i < dispatch_ring_count; i++) {
+        victim = &dispatch_rings[(home + i) % dispatch_ring_count];
+        if (__atomic_load_n (&victim->count, __ATOMIC_RELAXED) == 0
+                || pthread_mutex_trylock (&victim->mutex) != 0)
+            continue;
+        count = (victim->count + 1) / 2;
+        if (count > STEAL_BATCH)
+            count = STEAL_BATCH;
+        now = alarm_now ();
+        for (taken = 0; taken < count; taken++)
+            batch[taken] = ring_take (victim, now);
+        stats_count (STAT_STOLEN, taken);
+        ring_unlock (victim);
+        for (j = 0; j < taken; j++)
+            dispatch_deliver (batch[j]);
+        return taken;
+    }
+    return 0;
+}
+
+/*
+ * The dispatcher threads' start routine. "arg" is the index of
+ * the dispatcher's home ring.
+ */
+static void *dispatch_thread (void *arg)
+{
+    int home = (int)(intptr_t)arg;
+    ring_t *ring = &dispatch_rings[home];
+    alarm_t *alarm;
+    int status;
+
+    ring_lock (ring);
+    while (1) {
+        if (ring->count > 0) {
+            alarm = ring_take (ring, alarm_now ());
+            ring_unlock (ring);
+            dispatch_deliver (alarm);
+            ring_lock (ring);
+            continue;
+        }
+        ring->hint = 0;
+        ring_unlock (ring);
+        if (dispatch_steal (home) > 0) {
+            ring_lock (ring);
+            continue;
+        }
+        ring_lock (ring);
+        if (ring->count == 0 && !ring->hint) {
+            ring->idle++;
+            status = pthread_cond_wait (&ring->ready, &ring->mutex);
+            if (status != 0)
+                err_abort (status, "Wait on dispatch");
+            ring->idle--;
+        }
+    }
+}
+
+void dispatch_start (int rings, int workers, int capacity)
+{
+    pthread_t thread;
+    ring_t *ring;
+    void *block;
+    int i, status;
+
+    status = posix_memalign (&block, 64, rings * sizeof (ring_t));
+    if (status != 0)
+        err_abort (status, "Allocate dispatch rings");
+    dispatch_rings = (ring_t*)block;
+    dispatch_ring_count = rings;
+    dispatch_capacity = capacity;
+    dispatch_workers = workers;
+    for (i = 0; i < rings; i++) {
+        ring = &dispatch_rings[i];
+        memset (ring, 0, sizeof (ring_t));
+        status = pthread_mutex_init (&ring->mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init dispatch mutex");
+        status = pthread_cond_init (&ring->ready, NULL);
+        if (status != 0)
+            err_abort (status, "Init dispatch cond");
+        status = pthread_cond_init (&ring->space, NULL);
+        if (status != 0)
+            err_abort (status, "Init dispatch cond");
+        ring->slot = (alarm_t**)calloc (capacity, sizeof (alarm_t*));
+        if (ring->slot == NULL)
+            errno_abort ("Allocate dispatch ring");
+    }
+    for (i = 0; i < workers; i++) {
+        status = pthread_create (&thread, NULL, dispatch_thread,
+            (void*)(intptr_t)(i % rings));
+        if (status != 0)
+            err_abort (status, "Create dispatch thread");
+        pthread_detach (thread);
+    }
+}
+
+/*
+ * Wake an idle dispatcher on a ring other than "index" to come and
+ * steal from it. The rings are visited round-robin so the hints
+ * spread out, and only rings that have dispatchers of their own
+ * (there may be fewer dispatchers than rings). The caller must not
+ * have locked its ring, so that two alarm threads hinting at each
+ * other cannot deadlock.
+ */
+static void dispatch_hint (ring_t *ring, int index)
+{
+    ring_t *victim;
+    int status, busy = -1, i;
+
+    for (i = 0; i < dispatch_ring_count; i++) {
+        ring->victim = (ring->victim + 1) % dispatch_ring_count;
+        if (ring->victim == index || ring->victim >= dispatch_workers)
+            continue;
+        if (busy == -1)
+            busy = ring->victim;
+        victim = &dispatch_rings[ring->victim];
+        if (__atomic_load_n (&victim->idle, __ATOMIC_RELAXED) == 0)
+            continue;
+        ring_lock (victim);
+        if (victim->idle > 0) {
+            victim->hint = 1;
+            status = pthread_cond_signal (&victim->ready);
+            if (status != 0)
+                err_abort (status, "Signal dispatch");
+            ring_unlock (victim);
+            return;
+        }
+        ring_unlock (victim);
+    }
+
+    /*
+     * Every dispatcher looked busy. Each looks for a backlog to
+     * steal when it is done, but one may have looked just before
+     * the backlog built up, and be about to sleep: the hint stops
+     * it.
+     */
+    if (busy != -1) {
+        victim = &dispatch_rings[busy];
+        ring_lock (victim);
+        victim->hint = 1;
+        status = pthread_cond_signal (&victim->ready);
+        if (status != 0)
+            err_abort (status, "Signal dispatch");
+        ring_unlock (victim);
+    }
+}
+
+void dispatch_put (int index, alarm_t *list)
+{
+    ring_t *ring = &dispatch_rings[index];
+    alarm_t *alarm;
+    int status, backlog;
+
+    ring_lock (ring);
+    while (list != NULL) {
+        while (ring->count == dispatch_capacity) {
+            status = pthread_cond_broadcast (&ring->ready);
+            if (status != 0)
+                err_abort (status, "Signal dispatch");
+
+            /*
+             * With none of its own dispatchers free (or none at
+             * all), only a stealer can make room.
+             */
+            if (ring->idle == 0 && dispatch_ring_count > 1) {
+                ring_unlock (ring);
+                dispatch_hint (ring, index);
+                ring_lock (ring);
+                if (ring->count < dispatch_capacity)
+                    break;
+            }
+            status = pthread_cond_wait (&ring->space, &ring->mutex);
+            if (status != 0)
+                err_abort (status, "Wait on dispatch space");
+        }
+        alarm = list;
+        list = list->batch;
+        ring->slot[(ring->head + ring->count) % dispatch_capacity] = alarm;
+        if (++ring->count > ring->high_water)
+            ring->high_water = ring->count;
+    }
+    if (ring->idle > 0) {
+        if (ring->count > 1)
+            status = pthread_cond_broadcast (&ring->ready);
+        else
+            status = pthread_cond_signal (&ring->ready);
+        if (status != 0)
+            err_abort (status, "Signal dispatch");
+    }
+
+    /*
+     * Nobody at home is free to take a backlog, or the ring has no
+     * dispatcher of its own, and even one alarm would wait there
+     * for the next: bring a stealer.
+     */
+    backlog = ring->idle == 0 && (ring->count > 1 || index >= dispatch_workers);
+    ring_unlock (ring);
+    if (backlog && dispatch_ring_count > 1)
+        dispatch_hint (ring, index);
+}
+
+void dispatch_stats (dispatch_stats_t *stats)
+{
+    ring_t *ring;
+    int i;
+
+    memset (stats, 0, sizeof (dispatch_stats_t));
+    stats->capacity = dispatch_capacity;
+    stats->workers = dispatch_workers;
+    stats->rings = dispatch_ring_count;
+    for (i = 0; i < dispatch_ring_count; i++) {
+        ring = &dispatch_rings[i];
+        ring_lock (ring);
+        if (ring->high_water > stats->high_water)
+            stats->high_water = ring->high_water;
+        ring_unlock (ring);
+    }
+}
+
+/*
+ * Print how the pool was set up and how close the rings came to
+ * filling; the lateness figures are in stats_report.
+ */
+void dispatch_report (FILE *file)
+{
+    dispatch_stats_t stats;
+
+    dispatch_stats (&stats);
+    fprintf (file, "%d dispatchers on %d shards, queue high water %d/%d\n",
+        stats.workers, stats.rings, stats.high_water, stats.capacity);
+}
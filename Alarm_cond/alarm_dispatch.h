@@ -0,0 +1,48 @@
+#ifndef __alarm_dispatch_h
+#define __alarm_dispatch_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include "alarm.h"
+
+/*
+ * Delivery of expired alarms. An alarm thread only decides that
+ * an alarm has expired and hands it to dispatch_put; a pool of
+ * dispatcher threads prints it and releases it (see alarm_release). A slow terminal or a
+ * full pipe therefore stalls the dispatchers, not the timing of
+ * later alarms.
+ *
+ * There is one bounded ring per shard, and every dispatcher has a
+ * home ring (dispatchers are dealt out to the rings in turn). A
+ * dispatcher whose home ring is empty steals expired alarms from
+ * the other rings, so a busy shard's backlog is spread over idle
+ * dispatchers. If a ring fills anyway, dispatch_put blocks -- an
+ * alarm thread cannot get further ahead than "capacity" alarms.
+ */
+void dispatch_start (int rings, int workers, int capacity);
+/*
+ * Queue a list of expired alarms, chained through "batch", on a
+ * ring. The whole list goes in under one lock acquisition unless
+ * the ring fills part way. The caller must hold the clock (see
+ * alarm_clock.h) once for each alarm; each hold is released once
+ * the alarm has been delivered.
+ */
+void dispatch_put (int ring, alarm_t *list);
+
+/*
+ * Lateness (from an alarm's deadline to the moment a dispatcher
+ * starts delivering it) and the delivery counts go to the runtime
+ * statistics (see alarm_stats.h). "high_water" is the deepest any
+ * ring has been.
+ */
+typedef struct dispatch_stats_tag {
+    int                 high_water;
+    int                 capacity;
+    int                 workers;
+    int                 rings;
+} dispatch_stats_t;
+
+void dispatch_stats (dispatch_stats_t *stats);
+void dispatch_report (FILE *file);
+
+#endif
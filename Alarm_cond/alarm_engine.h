@@ -0,0 +1,44 @@
+#ifndef __alarm_engine_h
+#define __alarm_engine_h
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * The timing engine: how an alarm thread sleeps until a deadline
+ * and how other threads wake it early. Exactly one implementation
+ * is linked into the program (the Makefile's ENGINE variable picks
+ * it):
+ *
+ *      alarm_condvar.c pthread_cond_timedwait on a CLOCK_MONOTONIC
+ *                      condition variable (default)
+ *      alarm_timerfd.c a timerfd armed to the deadline and an
+ *                      eventfd for wakeups, multiplexed with epoll
+ *
+ * Each engine belongs to one waiting thread, whose "mutex" is
+ * passed to both routines. Deadlines are alarm_now() readings.
+ * Alarm threads reach their engines through the clock (see
+ * alarm_clock.h), which under virtual time only ever waits on
+ * them with no deadline.
+ */
+typedef struct engine_tag engine_t;
+
+engine_t *engine_create (void);
+
+/*
+ * Sleep until "deadline" (forever if it is INT64_MAX; a negative
+ * one has long passed) or until engine_wake is called. The caller must have locked "mutex"; it
+ * is locked again on return, but may have been released meanwhile.
+ * Returns ETIMEDOUT if the deadline has passed, otherwise 0 (which
+ * may also be a spurious wakeup). A wakeup is never lost: one that
+ * happens after the caller last released "mutex" ends the wait.
+ */
+int engine_wait (engine_t *engine, pthread_mutex_t *mutex, int64_t deadline);
+
+/*
+ * Wake the thread waiting on the engine. The caller must not have
+ * locked "mutex".
+ */
+void engine_wake (engine_t *engine, pthread_mutex_t *mutex);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * alarm_epoch.c
+ *
+ * Epoch-based reclamation (see alarm_epoch.h), after K. Fraser,
+ * "Practical lock-freedom" (2004).
+ *
+ * "epoch_global" only counts up. A reader advertises the epoch in
+ * which it entered its read-side section, and 0 outside one. The
+ * global epoch moves on from e to e + 1 only when every reader
+ * inside has entered in e. An item retired in epoch e (after it
+ * was unpublished) can only be held by readers that entered in e
+ * or earlier, so once the global epoch has reached e + 2 they have
+ * all left, and it can be reclaimed.
+ *
+ * Readers register on their first epoch_enter, on a list that is
+ * only ever pushed onto. The retiring thread fences before it
+ * reads the epoch (or looks for readers), and a reader publishes
+ * its epoch with a sequentially consistent store before it reads
+ * anything, so either the retiring thread sees the reader, or the
+ * reader cannot see what was retired.
+ *
+ * Retired items wait in a per-thread ring, oldest first, each with
+ * the epoch it was retired in.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include "alarm_epoch.h"
+#include "errors.h"
+
+#define EPOCH_BATCH     64              /* retirements per collection */
+#define LIMBO_MIN       256             /* must be a power of 2 */
+
+typedef struct reader_tag {
+    struct reader_tag   *next;
+    uint64_t            epoch;          /* 0 when outside */
+} reader_t;
+
+typedef struct retired_tag {
+    uint64_t            epoch;
+    void                (*reclaim) (void *item);
+    void                *item;
+} retired_t;
+
+typedef struct limbo_tag {
+    retired_t           *ring;
+    unsigned long       size;
+    unsigned long       first;          /* oldest */
+    unsigned long       count;
+} limbo_t;
+
+static uint64_t epoch_global = 1;
+static reader_t *epoch_readers = NULL;
+static __thread reader_t *epoch_self;
+static __thread limbo_t epoch_limbo;
+
+static reader_t *reader_register (void)
+{
+    reader_t *reader;
+
+    reader = (reader_t*)calloc (1, sizeof (reader_t));
+    if (reader == NULL)
+        errno_abort ("Allocate epoch reader");
+    reader->next = __atomic_load_n (&epoch_readers, __ATOMIC_SEQ_CST);
+    while (!__atomic_compare_exchange_n (&epoch_readers, &reader->next,
+            reader, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        ;
+    epoch_self = reader;
+    return reader;
+}
+
+void epoch_enter (void)
+{
+    reader_t *reader = epoch_self;
+
+    if (reader == NULL)
+        reader = reader_register ();
+    __atomic_store_n (&reader->epoch,
+        __atomic_load_n (&epoch_global, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit (void)
+{
+    __atomic_store_n (&epoch_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Move the global epoch on by one if no reader holds it back, and
+ * return it.
+ */
+static uint64_t epoch_advance (void)
+{
+    reader_t *reader;
+    uint64_t global, epoch;
+
+    global = __atomic_load_n (&epoch_global, __ATOMIC_SEQ_CST);
+    for (reader = __atomic_load_n (&epoch_readers, __ATOMIC_SEQ_CST);
+            reader != NULL; reader = reader->next) {
+        epoch = __atomic_load_n (&reader->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch != global)
+            return global;
+    }
+    if (__atomic_compare_exchange_n (&epoch_global, &global, global + 1,
+            0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return global + 1;
+    return global;                      /* someone else moved it */
+}
+
+long epoch_collect (void)
+{
+    limbo_t *limbo = &epoch_limbo;
+    retired_t *retired;
+    uint64_t global, newest, next;
+
+    if (limbo->count == 0)
+        return 0;
+    newest = limbo->ring[(limbo->first + limbo->count - 1)
+        & (limbo->size - 1)].epoch;
+    global = __atomic_load_n (&epoch_global, __ATOMIC_SEQ_CST);
+    while (global < newest + 2 && (next = epoch_advance ()) != global)
+        global = next;
+    while (limbo->count > 0) {
+        retired = &limbo->ring[limbo->first & (limbo->size - 1)];
+        if (retired->epoch + 2 > global)
+            break;
+        limbo->first++;
+        limbo->count--;
+        retired->reclaim (retired->item);
+    }
+    return limbo->count;
+}
+
+static void limbo_grow (limbo_t *limbo)
+{
+    retired_t *ring;
+    unsigned long i, size;
+
+    size = limbo->size == 0 ? LIMBO_MIN : limbo->size * 2;
+    ring = (retired_t*)malloc (size * sizeof (retired_t));
+    if (ring == NULL)
+        errno_abort ("Allocate epoch limbo");
+    for (i = 0; i < limbo->count; i++)
+        ring[i] = limbo->ring[(limbo->first + i) & (limbo->size - 1)];
+    free (limbo->ring);
+    limbo->ring = ring;
+    limbo->size = size;
+    limbo->first = 0;
+}
+
+void epoch_retire (void (*reclaim) (void *item), void *item)
+{
+    limbo_t *limbo = &epoch_limbo;
+    retired_t *retired;
+
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&epoch_readers, __ATOMIC_SEQ_CST) == NULL) {
+        reclaim (item);
+        return;
+    }
+    if (limbo->count == limbo->size)
+        limbo_grow (limbo);
+    retired = &limbo->ring[(limbo->first + limbo->count++) & (limbo->size - 1)];
+    retired->epoch = __atomic_load_n (&epoch_global, __ATOMIC_SEQ_CST);
+    retired->reclaim = reclaim;
+    retired->item = item;
+    if (limbo->count % EPOCH_BATCH == 0)
+        epoch_collect ();
+}
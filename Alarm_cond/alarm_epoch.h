@@ -0,0 +1,36 @@
+#ifndef __alarm_epoch_h
+#define __alarm_epoch_h
+
+/*
+ * Epoch-based reclamation, so that reader threads can look at data
+ * that another thread keeps changing -- a shard's index and its
+ * pending alarms (see alarm_index.h) -- without taking any lock.
+ *
+ * A reader brackets each look with epoch_enter and epoch_exit. The
+ * thread making a change publishes it first (a reader that starts
+ * afterwards cannot reach what it replaced) and then hands what it
+ * replaced to epoch_retire, which calls "reclaim" on it only once
+ * every reader that was inside at the time has left. Readers never
+ * wait for the writer, nor the writer for readers: a long read
+ * only holds back reclamation, so memory that the writer retires
+ * meanwhile piles up until the read ends.
+ *
+ * Until some thread first calls epoch_enter, epoch_retire reclaims
+ * at once.
+ *
+ * Read-side sections must not be nested. Each thread keeps its own
+ * list of retired items, and only that thread reclaims them:
+ * epoch_retire does so every EPOCH_BATCH items, and epoch_collect
+ * whenever the thread calls it.
+ */
+void epoch_enter (void);
+void epoch_exit (void);
+void epoch_retire (void (*reclaim) (void *item), void *item);
+
+/*
+ * Reclaim whatever the calling thread has retired that no reader
+ * can still see. Returns the number of items left waiting.
+ */
+long epoch_collect (void);
+
+#endif
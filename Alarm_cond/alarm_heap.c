@@ -0,0 +1,171 @@
+/*
+ * alarm_heap.c
+ *
+ * Pending alarms kept in an indexed 4-ary min-heap, ordered by
+ * expiration time. The earliest alarm is always heap[0], so the
+ * alarm thread can peek at it in O(1). Every alarm remembers its
+ * own position in "queue_slot", which lets an alarm be removed or
+ * moved to a new time with a single O(log n) sift instead of a
+ * search. Build with "make QUEUE=heap" to use it.
+ *
+ * A 4-ary heap is shallower than a binary one, and the four
+ * children of a node sit next to each other in the array, so a
+ * sift-down touches fewer cache lines.
+ */
+#include <stdlib.h>
+#include "alarm_queue.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+#define HEAP_ARITY      4
+#define HEAP_PARENT(i)  (((i) - 1) / HEAP_ARITY)
+#define HEAP_CHILD(i)   ((i) * HEAP_ARITY + 1)
+
+struct queue_tag {
+    alarm_t             **heap;
+    int                 count;
+    int                 size;
+};
+
+static void heap_set (queue_t *queue, int index, alarm_t *alarm)
+{
+    queue->heap[index] = alarm;
+    alarm->queue_slot = index;
+}
+
+static void heap_sift_up (queue_t *queue, int index)
+{
+    alarm_t *alarm, *parent;
+
+    alarm = queue->heap[index];
+    while (index > 0) {
+        parent = queue->heap[HEAP_PARENT (index)];
+        if (parent->time <= alarm->time)
+            break;
+        heap_set (queue, index, parent);
+        index = HEAP_PARENT (index);
+    }
+    heap_set (queue, index, alarm);
+}
+
+static void heap_sift_down (queue_t *queue, int index)
+{
+    alarm_t *alarm;
+    int child, last, best;
+
+    alarm = queue->heap[index];
+    while ((child = HEAP_CHILD (index)) < queue->count) {
+        last = child + HEAP_ARITY;
+        if (last > queue->count)
+            last = queue->count;
+        for (best = child++; child < last; child++)
+            if (queue->heap[child]->time < queue->heap[best]->time)
+                best = child;
+        if (queue->heap[best]->time >= alarm->time)
+            break;
+        heap_set (queue, index, queue->heap[best]);
+        index = best;
+    }
+    heap_set (queue, index, alarm);
+}
+
+queue_t *queue_create (void)
+{
+    queue_t *queue;
+
+    queue = (queue_t*)calloc (1, sizeof (queue_t));
+    if (queue == NULL)
+        errno_abort ("Allocate queue");
+    return queue;
+}
+
+void queue_destroy (queue_t *queue)
+{
+    free (queue->heap);
+    free (queue);
+}
+
+void queue_insert (queue_t *queue, alarm_t *alarm)
+{
+    alarm_t **heap;
+    int size;
+
+    if (queue->count == queue->size) {
+        size = queue->size ? queue->size * 2 : 64;
+        heap = (alarm_t**)realloc (queue->heap, size * sizeof (alarm_t*));
+        if (heap == NULL)
+            errno_abort ("Grow heap");
+        queue->heap = heap;
+        queue->size = size;
+    }
+    heap_set (queue, queue->count++, alarm);
+    heap_sift_up (queue, alarm->queue_slot);
+}
+
+/*
+ * Fill the hole with the last alarm in the heap and let it find
+ * its level, which may be above or below the hole.
+ */
+void queue_remove (queue_t *queue, alarm_t *alarm)
+{
+    alarm_t *moved;
+
+    moved = queue->heap[--queue->count];
+    if (moved == alarm)
+        return;
+    heap_set (queue, alarm->queue_slot, moved);
+    heap_sift_up (queue, moved->queue_slot);
+    heap_sift_down (queue, moved->queue_slot);
+}
+
+/*
+ * The alarm's time has changed: a decrease-key if it moved
+ * earlier, an increase-key if it moved later.
+ */
+void queue_update (queue_t *queue, alarm_t *alarm)
+{
+    heap_sift_up (queue, alarm->queue_slot);
+    heap_sift_down (queue, alarm->queue_slot);
+}
+
+int queue_empty (queue_t *queue)
+{
+    return queue->count == 0;
+}
+
+int64_t queue_next (queue_t *queue)
+{
+    return queue->heap[0]->time;
+}
+
+alarm_t *queue_expire (queue_t *queue, int64_t now)
+{
+    alarm_t *due, **last, *alarm;
+
+    due = NULL;
+    last = &due;
+    while (queue->count > 0 && queue->heap[0]->time <= now) {
+        alarm = queue->heap[0];
+        queue_remove (queue, alarm);
+        *last = alarm;
+        last = &alarm->link;
+    }
+    *last = NULL;
+    return due;
+}
+
+#ifdef DEBUG
+void queue_dump (queue_t *queue)
+{
+    alarm_t *next;
+    int index;
+
+    printf ("[heap: ");
+    for (index = 0; index < queue->count; index++) {
+        next = queue->heap[index];
+        printf ("%d:%lld(%lld)[\"%s\"] ", index, (long long)next->time,
+            (long long)(next->time - alarm_now ()), next->body->message);
+    }
+    printf ("]\n");
+}
+#endif
@@ -0,0 +1,165 @@
+/*
+ * alarm_index.c
+ *
+ * Open-addressing hash table from Message_Number to alarm_t. Keys
+ * are spread with a multiplicative (Fibonacci) hash and collisions
+ * are resolved by linear probing, which keeps a lookup to one or
+ * two adjacent cache lines.
+ *
+ * Deletion leaves a tombstone, which later insertions reuse, rather
+ * than shifting the rest of the probe run back: an entry never
+ * moves, so a reader walking the table without a lock cannot miss
+ * one or see it twice. Once alarms and tombstones fill half the
+ * table it is rebuilt without the tombstones, at twice the size if
+ * the alarms alone fill a quarter. The rebuilt table is published
+ * in one store, and the old one retired (see alarm_epoch.h), so a
+ * reader part way through it just finishes the walk there.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include "alarm_index.h"
+#include "alarm_epoch.h"
+#include "errors.h"
+
+#define INDEX_MIN_SIZE  64              /* must be a power of 2 */
+
+typedef struct table_tag {
+    unsigned long       mask;
+    alarm_t             *slot[];
+} table_t;
+
+struct index_tag {
+    table_t             *table;
+    unsigned long       count;          /* alarms */
+    unsigned long       used;           /* alarms and tombstones */
+};
+
+static alarm_t index_tombstone;
+#define TOMBSTONE       (&index_tombstone)
+
+static unsigned long index_hash (table_t *table, int number)
+{
+    return (unsigned long)(((uint64_t)(uint32_t)number
+        * 0x9E3779B97F4A7C15ULL) >> 32) & table->mask;
+}
+
+static table_t *table_alloc (unsigned long size)
+{
+    table_t *table;
+
+    table = (table_t*)calloc (1, sizeof (table_t) + size * sizeof (alarm_t*));
+    if (table == NULL)
+        errno_abort ("Allocate index");
+    table->mask = size - 1;
+    return table;
+}
+
+/*
+ * Return the first free slot (empty or a tombstone) of the
+ * number's probe run.
+ */
+static unsigned long table_free_slot (table_t *table, int number)
+{
+    unsigned long i;
+
+    i = index_hash (table, number);
+    while (table->slot[i] != NULL && table->slot[i] != TOMBSTONE)
+        i = (i + 1) & table->mask;
+    return i;
+}
+
+static void index_rebuild (index_t *index)
+{
+    table_t *old = index->table, *table;
+    unsigned long i, size;
+    alarm_t *alarm;
+
+    size = old->mask + 1;
+    if (index->count * 4 >= size)
+        size *= 2;
+    table = table_alloc (size);
+    for (i = 0; i <= old->mask; i++) {
+        alarm = old->slot[i];
+        if (alarm != NULL && alarm != TOMBSTONE)
+            table->slot[table_free_slot (table, alarm->Message_Number)] = alarm;
+    }
+    __atomic_store_n (&index->table, table, __ATOMIC_RELEASE);
+    index->used = index->count;
+    epoch_retire (free, old);
+}
+
+index_t *index_create (void)
+{
+    index_t *index;
+
+    index = (index_t*)calloc (1, sizeof (index_t));
+    if (index == NULL)
+        errno_abort ("Allocate index");
+    index->table = table_alloc (INDEX_MIN_SIZE);
+    return index;
+}
+
+void index_destroy (index_t *index)
+{
+    free (index->table);
+    free (index);
+}
+
+/*
+ * The alarm's Message_Number must not already be in the index.
+ */
+void index_insert (index_t *index, alarm_t *alarm)
+{
+    table_t *table;
+    unsigned long i;
+
+    if ((index->used + 1) * 2 > index->table->mask + 1)
+        index_rebuild (index);
+    table = index->table;
+    i = table_free_slot (table, alarm->Message_Number);
+    if (table->slot[i] == NULL)
+        index->used++;
+    index->count++;
+    __atomic_store_n (&table->slot[i], alarm, __ATOMIC_RELEASE);
+}
+
+alarm_t *index_find (index_t *index, int number)
+{
+    table_t *table = __atomic_load_n (&index->table, __ATOMIC_ACQUIRE);
+    alarm_t *alarm;
+    unsigned long i;
+
+    i = index_hash (table, number);
+    while ((alarm = __atomic_load_n (&table->slot[i], __ATOMIC_ACQUIRE)) != NULL) {
+        if (alarm != TOMBSTONE && alarm->Message_Number == number)
+            return alarm;
+        i = (i + 1) & table->mask;
+    }
+    return NULL;
+}
+
+void index_remove (index_t *index, alarm_t *alarm)
+{
+    table_t *table = index->table;
+    unsigned long i;
+
+    i = index_hash (table, alarm->Message_Number);
+    while (table->slot[i] != alarm)
+        i = (i + 1) & table->mask;
+    __atomic_store_n (&table->slot[i], TOMBSTONE, __ATOMIC_RELEASE);
+    index->count--;
+}
+
+void index_walk (index_t *index, void (*visit) (alarm_t *alarm, void *arg),
+    void *arg)
+{
+    table_t *table = __atomic_load_n (&index->table, __ATOMIC_ACQUIRE);
+    alarm_t *alarm;
+    unsigned long i;
+
+    for (i = 0; i <= table->mask; i++) {
+        alarm = __atomic_load_n (&table->slot[i], __ATOMIC_ACQUIRE);
+        if (alarm != NULL && alarm != TOMBSTONE)
+            visit (alarm, arg);
+    }
+}
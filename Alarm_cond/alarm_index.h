@@ -0,0 +1,40 @@
+#ifndef __alarm_index_h
+#define __alarm_index_h
+
+#include "alarm.h"
+
+/*
+ * An index from Message_Number to the pending alarm with that
+ * number, so that "Cancel: Message(n)" and same-number
+ * replacement find their alarm in O(1) instead of walking the
+ * queue. It must contain exactly the alarms that are in the
+ * pending queue.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * Like the queue, the index does no locking of its own; each
+ * shard's index is only changed by that shard's alarm thread.
+ * Other threads may call index_find and index_walk at the same
+ * time, without a lock, inside epoch_enter and epoch_exit (see
+ * alarm_epoch.h). An alarm taken out of the index must then not
+ * be freed until they are done with it.
+ */
+typedef struct index_tag index_t;
+
+index_t *index_create (void);
+void index_destroy (index_t *index);
+void index_insert (index_t *index, alarm_t *alarm);
+void index_remove (index_t *index, alarm_t *alarm);
+alarm_t *index_find (index_t *index, int number);
+
+/*
+ * Call "visit" on every alarm in the index, in no particular
+ * order. "visit" must not change the index. A walk made while the
+ * alarm thread changes the index visits every alarm that is in it
+ * throughout, once; alarms inserted or removed meanwhile may or
+ * may not be visited.
+ */
+void index_walk (index_t *index, void (*visit) (alarm_t *alarm, void *arg),
+    void *arg);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ * alarm_journal.c
+ *
+ * The write-ahead journal (see alarm_journal.h).
+ *
+ * Records are appended to "journal_pending" under journal_mutex.
+ * The flusher swaps that buffer for an empty one, and then writes
+ * and syncs it with the mutex released, so appending never waits
+ * for the disk unless the flusher has fallen JOURNAL_BACKLOG
+ * groups behind. Only the flusher touches the file.
+ *
+ * "journal_appended" and "journal_synced" count bytes appended and
+ * bytes on disk (and passed on) since the start; journal_flush
+ * waits for the second to catch up with the first.
+ *
+ * Lock order: an alarm thread appends FIRE records with its
+ * shard's mutex held, so journal_mutex is taken after shard
+ * mutexes, and the flusher never holds it while it locks a shard
+ * (when compacting). journal_fire never waits for room, since the
+ * flusher may need the shard to make it.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "alarm_journal.h"
+#include "alarm_shard.h"
+#include "alarm_index.h"
+#include "alarm_pool.h"
+#include "alarm_arena.h"
+#include "alarm_stats.h"
+#include "alarm_time.h"
+#include "alarm_clock.h"
+#include "errors.h"
+
+#define JOURNAL_BACKLOG 16              /* groups of "bytes" unsynced */
+#define RECORD_SIZE(length) \
+    ((sizeof (journal_record_t) + (length) + 7) & ~(size_t)7)
+
+typedef struct buffer_tag {
+    char                *data;
+    size_t              length;
+    size_t              room;
+} buffer_t;
+
+int journal_on = 0;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_ready;    /* flusher waits */
+static pthread_cond_t journal_done;     /* a group was synced */
+static buffer_t journal_pending;
+static alarm_t *journal_first;          /* commands awaiting sync */
+static alarm_t *journal_last;
+static long journal_commands;           /* ... each holding the clock */
+static int64_t journal_since;           /* first pending append (real) */
+static long journal_appended;
+static long journal_synced;
+
+static const char *journal_path;
+static int journal_fd = -1;
+static int64_t journal_interval;
+static size_t journal_bytes;
+static long journal_compact_size;
+static long journal_size;               /* of the file */
+static long journal_base;               /* ... after compaction */
+static int64_t journal_offset;          /* wall clock - monotonic */
+static void (*journal_durable) (alarm_t *first, alarm_t *last);
+
+static void journal_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&journal_mutex);
+    if (status != 0)
+        err_abort (status, "Lock journal");
+}
+
+static void journal_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&journal_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock journal");
+}
+
+/*
+ * FNV-1a, which is plenty to catch a torn write.
+ */
+static uint32_t checksum (const char *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+
+    while (length-- > 0)
+        hash = (hash ^ (unsigned char)*data++) * 16777619u;
+    return hash;
+}
+
+static void buffer_put (buffer_t *buffer, int type, int number,
+    int64_t deadline, int64_t interval, int64_t period, int64_t slack,
+    const char *text, size_t length)
+{
+    journal_record_t *record;
+    size_t size = RECORD_SIZE (length);
+
+    if (buffer->length + size > buffer->room) {
+        do
+            buffer->room = buffer->room < 4096 ? 4096 : buffer->room * 2;
+        while (buffer->length + size > buffer->room);
+        buffer->data = (char*)realloc (buffer->data, buffer->room);
+        if (buffer->data == NULL)
+            errno_abort ("Allocate journal buffer");
+    }
+    record = (journal_record_t*)(buffer->data + buffer->length);
+    memset (record, 0, size);
+    record->size = size;
+    record->type = type;
+    record->number = number;
+    record->deadline = deadline;
+    record->interval = interval;
+    record->period = period;
+    record->slack = slack;
+    record->length = length;
+    memcpy (record + 1, text, length);
+    record->check = checksum ((char*)&record->type,
+        size - offsetof (journal_record_t, type));
+    buffer->length += size;
+}
+
+static void alarm_put (buffer_t *buffer, int type, alarm_t *alarm)
+{
+    if (type == JOURNAL_CANCEL)
+        buffer_put (buffer, type, alarm->Message_Number, 0, 0, 0, 0, NULL, 0);
+    else
+        buffer_put (buffer, type, alarm->Message_Number,
+            __atomic_load_n (&alarm->body->deadline, __ATOMIC_RELAXED)
+            + journal_offset, alarm->body->interval,
+            alarm->period, alarm->body->slack, alarm->body->message, type == JOURNAL_SET ? alarm->body->length : 0);
+}
+
+/*
+ * Account for the records appended since journal_pending held
+ * "before" bytes, and wake the flusher if they start a group or
+ * complete one. The caller must have locked journal_mutex.
+ */
+static void journal_added (size_t before)
+{
+    int status;
+
+    journal_appended += journal_pending.length - before;
+    if (before == 0)
+        journal_since = real_now ();
+    if (before == 0 || (before < journal_bytes
+            && journal_pending.length >= journal_bytes)) {
+        status = pthread_cond_signal (&journal_ready);
+        if (status != 0)
+            err_abort (status, "Signal journal");
+    }
+}
+
+void journal_submit (alarm_t *first, alarm_t *last)
+{
+    alarm_t *command;
+    size_t before;
+    int status;
+
+    journal_lock ();
+    while (journal_pending.length >= JOURNAL_BACKLOG * journal_bytes) {
+        status = pthread_cond_wait (&journal_done, &journal_mutex);
+        if (status != 0)
+            err_abort (status, "Wait for journal");
+    }
+    before = journal_pending.length;
+    for (command = first; ; command = command->link) {
+        alarm_put (&journal_pending,
+            command->op == ALARM_CANCEL ? JOURNAL_CANCEL : JOURNAL_SET, command);
+        journal_commands++;
+        clock_hold (1);
+        if (command == last)
+            break;
+    }
+    if (journal_first == NULL)
+        journal_first = first;
+    else
+        journal_last->link = first;
+    journal_last = last;
+    journal_added (before);
+    journal_unlock ();
+}
+
+void journal_fire (alarm_t *list)
+{
+    size_t before;
+
+    if (!journal_on || list == NULL)
+        return;
+    journal_lock ();
+    before = journal_pending.length;
+    for (; list != NULL; list = list->batch)
+        if (list->period == 0)
+            alarm_put (&journal_pending, JOURNAL_FIRE, list);
+    journal_added (before);
+    journal_unlock ();
+}
+
+void journal_flush (void)
+{
+    long target;
+    int status;
+
+    if (!journal_on)
+        return;
+    journal_lock ();
+    target = journal_appended;
+    while (journal_synced < target) {
+        status = pthread_cond_wait (&journal_done, &journal_mutex);
+        if (status != 0)
+            err_abort (status, "Wait for journal");
+    }
+    journal_unlock ();
+}
+
+static void write_all (int fd, const char *data, size_t size)
+{
+    ssize_t done;
+
+    while (size > 0) {
+        done = write (fd, data, size);
+        if (done == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Write journal");
+        }
+        data += done;
+        size -= done;
+    }
+}
+
+/*
+ * Sync the directory holding "path", so that a rename into it is
+ * durable too.
+ */
+static void sync_directory (const char *path)
+{
+    char directory[4096];
+    const char *slash = strrchr (path, '/');
+    int fd;
+
+    if (slash == NULL)
+        strcpy (directory, ".");
+    else if (slash == path)
+        strcpy (directory, "/");
+    else
+        snprintf (directory, sizeof (directory), "%.*s", (int)(slash - path), path);
+    fd = open (directory, O_RDONLY);
+    if (fd != -1) {
+        fsync (fd);
+        close (fd);
+    }
+}
+
+static void compact_visit (alarm_t *alarm, void *arg)
+{
+    alarm_put ((buffer_t*)arg, JOURNAL_SET, alarm);
+}
+
+/*
+ * Replace the file with one SET record per pending alarm. The
+ * shards are walked without their locks (see shard_scan), so the
+ * alarm threads go on firing meanwhile. Every command already on
+ * disk is applied first, and no more can be until the flusher is
+ * done, so the only changes the walk can run into are firings.
+ * Their FIRE records are still in journal_pending, and will be
+ * written to the new file after the SETs; one for an alarm that
+ * the walk missed matches nothing when replayed.
+ */
+static void journal_compact (void)
+{
+    journal_header_t header;
+    buffer_t out;
+    char temp[4096];
+    int i, fd;
+
+    memset (&out, 0, sizeof (out));
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, JOURNAL_MAGIC, sizeof (header.magic));
+    header.version = JOURNAL_VERSION;
+    for (i = 0; i < shard_count; i++)
+        shard_scan (&shards[i], compact_visit, &out);
+    snprintf (temp, sizeof (temp), "%s.tmp", journal_path);
+    fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        errno_abort ("Create journal");
+    write_all (fd, (char*)&header, sizeof (header));
+    write_all (fd, out.data, out.length);
+    if (fsync (fd) == -1)
+        errno_abort ("Sync journal");
+    if (rename (temp, journal_path) == -1)
+        errno_abort ("Rename journal");
+    sync_directory (journal_path);
+    if (journal_fd != -1)
+        close (journal_fd);
+    journal_fd = fd;
+    journal_size = journal_base = sizeof (header) + out.length;
+    free (out.data);
+}
+
+/*
+ * The flusher thread's start routine. It waits for a group to
+ * fill, or for "interval" to pass since the group was started,
+ * then writes and syncs the group and passes its commands on.
+ */
+static void *journal_thread (void *arg)
+{
+    buffer_t writing;
+    struct timespec until;
+    alarm_t *first, *last;
+    int64_t deadline;
+    long target, commands;
+    int status;
+
+    memset (&writing, 0, sizeof (writing));
+    journal_lock ();
+    while (1) {
+        while (journal_pending.length == 0) {
+            status = pthread_cond_wait (&journal_ready, &journal_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on journal");
+        }
+        deadline = journal_since + journal_interval;
+        until.tv_sec = deadline / NSEC_PER_SEC;
+        until.tv_nsec = deadline % NSEC_PER_SEC;
+        while (journal_pending.length < journal_bytes) {
+            status = pthread_cond_timedwait (&journal_ready, &journal_mutex, &until);
+            if (status == ETIMEDOUT)
+                break;
+            if (status != 0)
+                err_abort (status, "Wait on journal");
+        }
+
+        /*
+         * Take the whole group, leaving the spare buffer for
+         * appends made while it is written.
+         */
+        writing.length = 0;
+        {
+            buffer_t swap = writing;
+
+            writing = journal_pending;
+            journal_pending = swap;
+        }
+        first = journal_first;
+        last = journal_last;
+        journal_first = journal_last = NULL;
+        commands = journal_commands;
+        journal_commands = 0;
+        target = journal_appended;
+        journal_unlock ();
+
+        write_all (journal_fd, writing.data, writing.length);
+        if (fdatasync (journal_fd) == -1)
+            errno_abort ("Sync journal");
+        journal_size += writing.length;
+        stats_count (STAT_JOURNAL_SYNCS, 1);
+        stats_count (STAT_JOURNAL_BYTES, writing.length);
+        if (first != NULL) {
+            journal_durable (first, last);
+            clock_release (commands);
+        }
+
+        journal_lock ();
+        journal_synced = target;
+        status = pthread_cond_broadcast (&journal_done);
+        if (status != 0)
+            err_abort (status, "Broadcast journal");
+        if (journal_size > journal_compact_size && journal_size > 2 * journal_base) {
+            journal_unlock ();
+            journal_compact ();
+            journal_lock ();
+        }
+    }
+}
+
+void journal_start (const char *path, int64_t interval, long bytes,
+    long compact, void (*durable) (alarm_t *first, alarm_t *last))
+{
+    pthread_condattr_t cond_attr;
+    pthread_t thread;
+    int status;
+
+    journal_path = path;
+    journal_interval = interval;
+    journal_bytes = bytes;
+    journal_compact_size = compact;
+    journal_durable = durable;
+    journal_offset = alarm_wall () - alarm_now ();
+    status = pthread_condattr_init (&cond_attr);
+    if (status != 0)
+        err_abort (status, "Init cond attr");
+    status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0)
+        err_abort (status, "Set cond clock");
+    status = pthread_cond_init (&journal_ready, &cond_attr);
+    if (status != 0)
+        err_abort (status, "Init journal cond");
+    pthread_condattr_destroy (&cond_attr);
+    status = pthread_cond_init (&journal_done, NULL);
+    if (status != 0)
+        err_abort (status, "Init journal cond");
+    journal_on = 1;
+    journal_compact ();
+    status = pthread_create (&thread, NULL, journal_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create journal thread");
+    pthread_detach (thread);
+}
+
+typedef struct replay_tag {
+    alarm_t             **first;
+    alarm_t             **last;
+    int64_t             offset;         /* monotonic - wall clock */
+    int64_t             now;
+    long                count;
+    long                overdue;
+} replay_t;
+
+/*
+ * Turn a replayed alarm's wall clock deadline (kept in its body's
+ * "deadline" while replaying) into a monotonic one, pick its "time"
+ * in its slack window, and chain it onto its shard's list.
+ */
+static void replay_visit (alarm_t *alarm, void *arg)
+{
+    replay_t *replay = (replay_t*)arg;
+    int shard = shard_for (alarm->Message_Number) - shards;
+
+    alarm->op = ALARM_SET;
+    alarm->body->deadline += replay->offset;
+    alarm->time = deadline_slack (alarm->body->deadline, alarm->body->slack);
+    alarm->link = NULL;
+    if (alarm->body->deadline <= replay->now)
+        replay->overdue++;
+    replay->count++;
+    if (replay->first[shard] == NULL)
+        replay->first[shard] = alarm;
+    else
+        replay->last[shard]->link = alarm;
+    replay->last[shard] = alarm;
+}
+
+long journal_replay (const char *path, long *overdue)
+{
+    journal_header_t *header;
+    journal_record_t *record;
+    index_t *live;
+    alarm_t *alarm;
+    replay_t replay;
+    struct stat info;
+    char *map, *p, *end;
+    int fd, shard;
+
+    *overdue = 0;
+    fd = open (path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat (fd, &info) == -1) {
+        close (fd);
+        return -1;
+    }
+    if (info.st_size == 0) {
+        close (fd);
+        return 0;
+    }
+    if (info.st_size < (off_t)sizeof (journal_header_t)) {
+        close (fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = (char*)mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise (map, info.st_size, MADV_SEQUENTIAL);
+    header = (journal_header_t*)map;
+    if (memcmp (header->magic, JOURNAL_MAGIC, sizeof (header->magic)) != 0
+            || header->version != JOURNAL_VERSION) {
+        munmap (map, info.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Replay into an index of our own, keyed by Message_Number, with
+     * each alarm's body holding its wall clock deadline until
+     * replay_visit makes it monotonic.
+     */
+    live = index_create ();
+    end = map + info.st_size;
+    for (p = map + sizeof (journal_header_t);
+            end - p >= (ptrdiff_t)sizeof (journal_record_t); p += record->size) {
+        record = (journal_record_t*)p;
+        if (record->size < sizeof (journal_record_t) || record->size % 8 != 0
+                || record->size > end - p
+                || record->length > record->size - sizeof (journal_record_t)
+                || record->check != checksum ((char*)&record->type,
+                    record->size - offsetof (journal_record_t, type)))
+            break;
+        alarm = index_find (live, record->number);
+        switch (record->type) {
+        case JOURNAL_SET:
+            if (alarm == NULL) {
+                alarm = alarm_alloc (record->length);
+                alarm->Message_Number = record->number;
+                index_insert (live, alarm);
+            } else {
+                body_free (alarm->body);
+                alarm->body = body_alloc (record->length);
+            }
+            alarm->body->client = 0;
+            alarm->body->interval = record->interval;
+            memcpy (alarm->body->message, record + 1, record->length);
+            alarm->body->message[record->length] = '\0';
+            alarm->period = record->period;
+            alarm->body->deadline = record->deadline;
+            alarm->body->slack = record->slack;
+            break;
+        case JOURNAL_FIRE:
+            if (alarm == NULL || alarm->body->deadline != record->deadline)
+                break;
+            /* fall through */
+        case JOURNAL_CANCEL:
+            if (alarm != NULL) {
+                index_remove (live, alarm);
+                alarm_free (alarm);
+            }
+            break;
+        }
+    }
+    munmap (map, info.st_size);
+
+    memset (&replay, 0, sizeof (replay));
+    replay.first = (alarm_t**)calloc (shard_count, sizeof (alarm_t*));
+    replay.last = (alarm_t**)calloc (shard_count, sizeof (alarm_t*));
+    if (replay.first == NULL || replay.last == NULL)
+        errno_abort ("Allocate journal replay");
+    replay.now = alarm_now ();
+    replay.offset = replay.now - alarm_wall ();
+    index_walk (live, replay_visit, &replay);
+    index_destroy (live);
+    for (shard = 0; shard < shard_count; shard++)
+        if (replay.first[shard] != NULL)
+            shard_submit (&shards[shard], replay.first[shard], replay.last[shard]);
+    free (replay.first);
+    free (replay.last);
+    *overdue = replay.overdue;
+    return replay.count;
+}
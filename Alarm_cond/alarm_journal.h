@@ -0,0 +1,112 @@
+#ifndef __alarm_journal_h
+#define __alarm_journal_h
+
+#include <stdint.h>
+#include "alarm.h"
+
+/*
+ * The write-ahead journal. Every command accepted by the front end
+ * is appended to a log file before it is acted on, so that a
+ * crashed or killed program can rebuild its pending alarms from
+ * the log when it starts again.
+ *
+ * Appending only copies the record into a memory buffer. A flusher
+ * thread writes the buffer out and syncs it once every "interval",
+ * or as soon as "bytes" have built up, so that one fsync makes a
+ * whole group of commands durable. Only then does it pass the
+ * commands on (see journal_submit), so a command is never
+ * acknowledged, or applied, before it is on disk.
+ *
+ * Alarm threads also append a FIRE record for every alarm that
+ * falls due, so that replay does not fire it again. These are not
+ * waited for: an alarm that fires just before a crash may fire
+ * again after it, but no alarm is lost. A periodic alarm stays
+ * pending when it fires and so gets no FIRE record; after a crash
+ * it fires once for the periods it missed and then keeps to its
+ * schedule.
+ *
+ * The file is a header followed by records:
+ *
+ *      journal_header_t
+ *      journal_record_t, then "length" bytes of text, padded to a
+ *      multiple of 8 bytes, repeated
+ *
+ * Each record carries a checksum, and replay stops at the first
+ * record that is torn or damaged. Deadlines are CLOCK_REALTIME
+ * nanoseconds, as in a snapshot (see alarm_snapshot.h).
+ *
+ * Once the file has doubled in size since it was last compacted
+ * (and is over "compact" bytes), the flusher rewrites it as one
+ * SET record per pending alarm.
+ */
+#define JOURNAL_MAGIC           "ALRMJRNL"
+#define JOURNAL_VERSION         3
+
+#define JOURNAL_SET             1       /* set or replace */
+#define JOURNAL_CANCEL          2
+#define JOURNAL_FIRE            3       /* fell due */
+
+typedef struct journal_header_tag {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            unused;
+} journal_header_t;
+
+typedef struct journal_record_tag {
+    uint32_t            size;           /* whole record, padded */
+    uint32_t            check;          /* of the bytes after this */
+    int32_t             type;           /* JOURNAL_* */
+    int32_t             number;         /* Message_Number */
+    int64_t             deadline;       /* wall clock, nsec */
+    int64_t             interval;       /* as requested, nsec */
+    int64_t             period;         /* 0, or nsec between firings */
+    int64_t             slack;          /* nsec */
+    uint32_t            length;         /* of the text */
+    uint32_t            unused;
+} journal_record_t;
+
+/*
+ * Rebuild the pending alarms from the journal at "path" and submit
+ * them to their shards. A FIRE record only clears an alarm whose
+ * deadline it matches, so one that was replaced just as it fell
+ * due survives. Returns the number of alarms pending, of which
+ * "overdue" are already due, or -1 (with errno set) if the file
+ * exists but is not a journal. A missing file replays nothing.
+ */
+long journal_replay (const char *path, long *overdue);
+
+/*
+ * Compact "path" (so that it starts out without any torn tail),
+ * then start the flusher. "durable" is called on the flusher
+ * thread with each group of commands once they are on disk, chained
+ * first..last through "link" in the order they were submitted.
+ */
+void journal_start (const char *path, int64_t interval, long bytes,
+    long compact, void (*durable) (alarm_t *first, alarm_t *last));
+
+/*
+ * Non-zero once journal_start has been called.
+ */
+extern int journal_on;
+
+/*
+ * Append the commands chained first..last through "link", and pass
+ * them to "durable" once they are on disk. The journal takes the
+ * alarms over.
+ */
+void journal_submit (alarm_t *first, alarm_t *last);
+
+/*
+ * Append a FIRE record for each one-shot alarm of the list (chained
+ * through "batch"); a periodic alarm stays pending when it fires.
+ * Does nothing unless the journal is on.
+ */
+void journal_fire (alarm_t *list);
+
+/*
+ * Wait until everything submitted so far is on disk and has been
+ * passed to "durable".
+ */
+void journal_flush (void);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * alarm_list.c
+ *
+ * The original pending-alarm store: a singly linked list kept
+ * sorted by expiration time. Insertion walks the list from the
+ * head, so it costs O(n); expiry just pops the head. Build with
+ * "make QUEUE=list" to use it.
+ *
+ * Each alarm's "back" member points at the link that points at
+ * it, so removal does not have to search for the predecessor.
+ */
+#include <stdlib.h>
+#include "alarm_queue.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+struct queue_tag {
+    alarm_t             *head;
+};
+
+queue_t *queue_create (void)
+{
+    queue_t *queue;
+
+    queue = (queue_t*)calloc (1, sizeof (queue_t));
+    if (queue == NULL)
+        errno_abort ("Allocate queue");
+    return queue;
+}
+
+void queue_destroy (queue_t *queue)
+{
+    free (queue);
+}
+
+/*
+ * Insert alarm entry on list, in order.
+ */
+void queue_insert (queue_t *queue, alarm_t *alarm)
+{
+    alarm_t **last, *next;
+
+    last = &queue->head;
+    next = *last;
+    while (next != NULL) {
+        if (next->time >= alarm->time) {
+            alarm->link = next;
+            alarm->back = last;
+            next->back = &alarm->link;
+            *last = alarm;
+            break;
+        }
+        last = &next->link;
+        next = next->link;
+    }
+    /*
+     * If we reached the end of the list, insert the new alarm
+     * there.  ("next" is NULL, and "last" points to the link
+     * field of the last item, or to the list header.)
+     */
+    if (next == NULL) {
+        *last = alarm;
+        alarm->link = NULL;
+        alarm->back = last;
+    }
+}
+
+void queue_remove (queue_t *queue, alarm_t *alarm)
+{
+    *alarm->back = alarm->link;
+    if (alarm->link != NULL)
+        alarm->link->back = alarm->back;
+}
+
+void queue_update (queue_t *queue, alarm_t *alarm)
+{
+    queue_remove (queue, alarm);
+    queue_insert (queue, alarm);
+}
+
+int queue_empty (queue_t *queue)
+{
+    return queue->head == NULL;
+}
+
+int64_t queue_next (queue_t *queue)
+{
+    return queue->head->time;
+}
+
+/*
+ * The due alarms are a prefix of the list: cut it off after the
+ * last one.
+ */
+alarm_t *queue_expire (queue_t *queue, int64_t now)
+{
+    alarm_t *due, **last;
+
+    due = queue->head;
+    last = &queue->head;
+    while (*last != NULL && (*last)->time <= now)
+        last = &(*last)->link;
+    if (last == &queue->head)
+        return NULL;
+    queue->head = *last;
+    if (queue->head != NULL)
+        queue->head->back = &queue->head;
+    *last = NULL;
+    return due;
+}
+
+#ifdef DEBUG
+void queue_dump (queue_t *queue)
+{
+    alarm_t *next;
+
+    printf ("[list: ");
+    for (next = queue->head; next != NULL; next = next->link)
+        printf ("%lld(%lld)[\"%s\"] ", (long long)next->time,
+            (long long)(next->time - alarm_now ()), next->body->message);
+    printf ("]\n");
+}
+#endif
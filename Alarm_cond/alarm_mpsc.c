@@ -0,0 +1,69 @@
+/*
+ * alarm_mpsc.c
+ *
+ * Vyukov's intrusive MPSC queue. "head" is the most recently
+ * pushed node; each node's "link" points at the node pushed after
+ * it. The consumer owns "tail". A stub node keeps the queue from
+ * ever being truly empty, which is what lets a push be a single
+ * exchange.
+ */
+#include <stddef.h>
+#include "alarm_mpsc.h"
+
+void mpsc_init (mpsc_t *queue)
+{
+    queue->stub.link = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_push (mpsc_t *queue, alarm_t *first, alarm_t *last)
+{
+    alarm_t *prev;
+
+    __atomic_store_n (&last->link, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n (&queue->head, last, __ATOMIC_SEQ_CST);
+    __atomic_store_n (&prev->link, first, __ATOMIC_RELEASE);
+}
+
+alarm_t *mpsc_pop (mpsc_t *queue)
+{
+    alarm_t *tail, *next, *head;
+
+    tail = queue->tail;
+    next = __atomic_load_n (&tail->link, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n (&next->link, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    head = __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE);
+    if (tail != head)
+        return NULL;            /* a push is half done */
+    /*
+     * "tail" is the last node. Put the stub back behind it so
+     * that "tail" can be handed out.
+     */
+    mpsc_push (queue, &queue->stub, &queue->stub);
+    next = __atomic_load_n (&tail->link, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+int mpsc_pending (mpsc_t *queue)
+{
+    alarm_t *head;
+
+    head = __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST);
+    return head != queue->tail
+        || __atomic_load_n (&queue->tail->link, __ATOMIC_ACQUIRE) != NULL;
+}
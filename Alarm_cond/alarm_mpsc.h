@@ -0,0 +1,39 @@
+#ifndef __alarm_mpsc_h
+#define __alarm_mpsc_h
+
+#include "alarm.h"
+
+/*
+ * A lock-free, intrusive, multi-producer single-consumer queue of
+ * alarms (Vyukov's algorithm), chained through "link". Any number
+ * of threads may push concurrently; only one thread may pop.
+ *
+ * A push is a single atomic exchange, so producers never wait for
+ * each other or for the consumer. The price is a short window
+ * during which a producer has claimed its place but not yet linked
+ * its node in; mpsc_pop then returns NULL although the queue is
+ * not empty, and mpsc_pending tells the consumer to come back.
+ */
+typedef struct mpsc_tag {
+    alarm_t             *head;          /* producers' end */
+    alarm_t             *tail;          /* consumer's end */
+    alarm_t             stub;
+} mpsc_t;
+
+void mpsc_init (mpsc_t *queue);
+
+/*
+ * Push a list of nodes already chained first..last through "link"
+ * (first == last for a single node).
+ */
+void mpsc_push (mpsc_t *queue, alarm_t *first, alarm_t *last);
+
+alarm_t *mpsc_pop (mpsc_t *queue);
+
+/*
+ * Non-zero if anything has been pushed that has not been popped,
+ * including a push that is still in progress.
+ */
+int mpsc_pending (mpsc_t *queue);
+
+#endif
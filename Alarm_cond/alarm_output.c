@@ -0,0 +1,578 @@
+/*
+ * alarm_output.c
+ *
+ * The output ring is a bounded multi-producer queue of
+ * OUTPUT_SLOTS fixed-size slots (Vyukov's algorithm). Each slot
+ * carries a sequence number that says whose turn it is: a producer
+ * may fill slot "pos" when its sequence is "pos", and publishes it
+ * by setting the sequence to pos + 1; the writer empties it and
+ * hands it to the next lap by setting it to pos + OUTPUT_SLOTS. A
+ * producer claims its position with one compare-and-swap and then
+ * formats straight into the slot. A line too long for a slot is
+ * formatted into a malloc'ed buffer that the slot points to.
+ *
+ * The writer gathers the run of published slots for one
+ * descriptor into an iovec and writes them with one writev, and
+ * only then gives the slots back, so that the iovec can point into
+ * them.
+ * A slot whose "length" is OUTPUT_CLOSE ends a run; the writer
+ * closes its descriptor instead of writing it.
+ *
+ * The writer never waits for a descriptor. What a full one (a
+ * client's non-blocking socket) does not take goes into that
+ * descriptor's backlog, a buffer of its own, and so do its later
+ * lines until the backlog is written out; the writer retries
+ * backlogs every OUTPUT_RETRY milliseconds, between runs and while
+ * it would otherwise sleep. A client whose backlog passes
+ * OUTPUT_BACKLOG bytes is not reading: everything it is owed is
+ * dropped, and so is every later line for it until its descriptor
+ * is closed, and its socket is shut down so that the server drops
+ * it. One client that never reads therefore costs the others
+ * nothing.
+ *
+ * The writer sleeps on output_ready when it finds nothing to do,
+ * and producers that find the ring full (in OUTPUT_BLOCK mode) or
+ * that are flushing sleep on output_space. Each side sets a flag
+ * before its last look at the ring, and the other side looks at
+ * the flag after changing the ring, with sequentially consistent
+ * operations, so only a thread that may really be asleep is
+ * signalled and no wakeup is lost.
+ */
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "alarm_output.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+#define OUTPUT_SLOTS    4096            /* must be a power of 2 */
+#define OUTPUT_IOV      64              /* slots per writev */
+#define OUTPUT_TEXT     104
+#define OUTPUT_SPIN     64              /* yields before sleeping */
+#define OUTPUT_BACKLOG  (256 * 1024)    /* bytes a client may owe */
+#define OUTPUT_RETRY    10              /* msec between backlog writes */
+#define OUTPUT_CLOSE    -1              /* slot "length": close "fd" */
+
+typedef struct slot_tag {
+    uint64_t            sequence;
+    int                 fd;
+    int                 length;
+    char                *heap;          /* long line, or NULL */
+    char                text[OUTPUT_TEXT];
+} slot_t;
+
+static slot_t *output_ring;
+static uint64_t output_enqueue;         /* producers' next position */
+static uint64_t output_dequeue;         /* writer's next position */
+static int output_full;
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_space = PTHREAD_COND_INITIALIZER;
+static int output_sleeping;             /* writer waits on output_ready */
+static int output_waiters;              /* threads wait on output_space */
+static long output_lost;                /* not yet noted (OUTPUT_COUNT) */
+
+/*
+ * What a descriptor is owed. Indexed by descriptor, and only
+ * touched by the writer.
+ */
+typedef struct backlog_tag {
+    char                *data;
+    size_t              length;
+    size_t              room;
+    long                lines;
+    int                 dead;           /* given up until closed */
+} backlog_t;
+
+static backlog_t *output_backlog;
+static int output_backlog_size;
+static int output_backlogged;           /* descriptors owed anything */
+
+/*
+ * Totals for output_report.
+ */
+static long output_lines;
+static long output_writes;
+static long output_dropped;
+static long output_blocked;
+
+static void output_lock (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Lock output");
+}
+
+static void output_unlock (void)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&output_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock output");
+}
+
+static backlog_t *backlog_for (int fd)
+{
+    backlog_t *backlog;
+    int size;
+
+    if (fd >= output_backlog_size) {
+        size = output_backlog_size == 0 ? 64 : output_backlog_size;
+        while (size <= fd)
+            size *= 2;
+        backlog = (backlog_t*)realloc (output_backlog, size * sizeof (backlog_t));
+        if (backlog == NULL)
+            errno_abort ("Allocate output backlog");
+        memset (backlog + output_backlog_size, 0,
+            (size - output_backlog_size) * sizeof (backlog_t));
+        output_backlog = backlog;
+        output_backlog_size = size;
+    }
+    return &output_backlog[fd];
+}
+
+/*
+ * Drop whatever "fd" is owed, and "more" lines besides. A client
+ * is given up on for good (until its descriptor is closed), and
+ * its socket shut down so that the server notices.
+ */
+static void backlog_drop (int fd, backlog_t *backlog, long more)
+{
+    __atomic_add_fetch (&output_dropped, backlog->lines + more, __ATOMIC_RELAXED);
+    if (backlog->length > 0)
+        output_backlogged--;
+    free (backlog->data);
+    backlog->data = NULL;
+    backlog->length = backlog->room = 0;
+    backlog->lines = 0;
+    if (fd > STDERR_FILENO && !backlog->dead) {
+        backlog->dead = 1;
+        shutdown (fd, SHUT_RDWR);
+    }
+}
+
+static void backlog_append (backlog_t *backlog, struct iovec *iov, int count)
+{
+    size_t needed;
+    int i;
+
+    if (backlog->length == 0)
+        output_backlogged++;
+    for (i = 0; i < count; i++) {
+        needed = backlog->length + iov[i].iov_len;
+        if (needed > backlog->room) {
+            backlog->room = backlog->room == 0 ? 4096 : backlog->room;
+            while (backlog->room < needed)
+                backlog->room *= 2;
+            backlog->data = (char*)realloc (backlog->data, backlog->room);
+            if (backlog->data == NULL)
+                errno_abort ("Allocate output backlog");
+        }
+        memcpy (backlog->data + backlog->length, iov[i].iov_base, iov[i].iov_len);
+        backlog->length = needed;
+    }
+    backlog->lines += count;
+}
+
+/*
+ * Write as much of "iov" as "fd" takes without waiting, and return
+ * how many of its entries are left (the first possibly in part).
+ * Returns -1 if the reader has gone.
+ */
+static int output_try (int fd, struct iovec *iov, int count)
+{
+    ssize_t done;
+    int left = count;
+
+    while (left > 0) {
+        done = writev (fd, iov, left);
+        if (done == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            if (errno != EPIPE && errno != ECONNRESET)
+                errno_abort ("Write output");
+            return -1;
+        }
+        __atomic_store_n (&output_writes, output_writes + 1, __ATOMIC_RELAXED);
+        while (left > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            left--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return left;
+}
+
+/*
+ * Write "iov" to "fd", or add it to the descriptor's backlog if
+ * the descriptor is full or already owed something, so that its
+ * lines stay in order.
+ */
+static void output_write (int fd, struct iovec *iov, int count)
+{
+    backlog_t *backlog = backlog_for (fd);
+    int left = count;
+
+    if (backlog->dead) {
+        __atomic_add_fetch (&output_dropped, count, __ATOMIC_RELAXED);
+        return;
+    }
+    if (backlog->length == 0) {
+        left = output_try (fd, iov, count);
+        if (left == -1) {
+            backlog_drop (fd, backlog, count);
+            return;
+        }
+        if (left == 0)
+            return;
+    }
+    backlog_append (backlog, iov + count - left, left);
+    if (backlog->length > OUTPUT_BACKLOG)
+        backlog_drop (fd, backlog, 0);
+}
+
+/*
+ * Write out as much of "fd"'s backlog as it takes now.
+ */
+static void backlog_write (int fd, backlog_t *backlog)
+{
+    struct iovec iov;
+    size_t written;
+    int left;
+
+    iov.iov_base = backlog->data;
+    iov.iov_len = backlog->length;
+    left = output_try (fd, &iov, 1);
+    if (left == -1) {
+        backlog_drop (fd, backlog, 0);
+        return;
+    }
+    written = backlog->length - (left == 0 ? 0 : iov.iov_len);
+    if (written == backlog->length) {
+        backlog->length = 0;
+        backlog->lines = 0;
+        output_backlogged--;
+    } else if (written > 0) {
+        memmove (backlog->data, backlog->data + written, backlog->length - written);
+        backlog->length -= written;
+    }
+}
+
+static void backlog_retry (void)
+{
+    int fd;
+
+    for (fd = 0; fd < output_backlog_size && output_backlogged > 0; fd++)
+        if (output_backlog[fd].length > 0)
+            backlog_write (fd, &output_backlog[fd]);
+}
+
+/*
+ * "fd" is being closed: give it a last chance to take what it is
+ * owed, and forget it, since the number may be reused.
+ */
+static void backlog_close (int fd)
+{
+    backlog_t *backlog = backlog_for (fd);
+
+    if (backlog->length > 0)
+        backlog_write (fd, backlog);
+    if (backlog->length > 0)
+        backlog_drop (fd, backlog, 0);
+    free (backlog->data);
+    memset (backlog, 0, sizeof (backlog_t));
+}
+
+static void *output_thread (void *arg)
+{
+    struct iovec iov[OUTPUT_IOV];
+    struct timespec until;
+    slot_t *slot;
+    uint64_t pos;
+    int64_t now, retried = 0;
+    int count, i, status, closing, idle = 0;
+
+    while (1) {
+        if (output_backlogged > 0
+                && (now = real_now ()) - retried >= OUTPUT_RETRY * NSEC_PER_MSEC) {
+            backlog_retry ();
+            retried = now;
+        }
+        pos = output_dequeue;
+        for (count = 0; count < OUTPUT_IOV; count++) {
+            slot = &output_ring[(pos + count) & (OUTPUT_SLOTS - 1)];
+            if (__atomic_load_n (&slot->sequence, __ATOMIC_SEQ_CST) != pos + count + 1)
+                break;
+            if (count > 0 && slot->fd != output_ring[pos & (OUTPUT_SLOTS - 1)].fd)
+                break;
+            if (slot->length == OUTPUT_CLOSE) {
+                if (count == 0)
+                    iov[count++].iov_len = 0;
+                break;
+            }
+            iov[count].iov_base = slot->heap != NULL ? slot->heap : slot->text;
+            iov[count].iov_len = slot->length;
+        }
+        if (count == 0 && idle++ < OUTPUT_SPIN) {
+            sched_yield ();
+            continue;
+        }
+        if (count == 0) {
+            output_lock ();
+            __atomic_store_n (&output_sleeping, 1, __ATOMIC_SEQ_CST);
+            slot = &output_ring[pos & (OUTPUT_SLOTS - 1)];
+            if (__atomic_load_n (&slot->sequence, __ATOMIC_SEQ_CST) != pos + 1) {
+                if (output_backlogged > 0) {
+                    clock_gettime (CLOCK_REALTIME, &until);
+                    until.tv_nsec += OUTPUT_RETRY * NSEC_PER_MSEC;
+                    if (until.tv_nsec >= NSEC_PER_SEC) {
+                        until.tv_sec++;
+                        until.tv_nsec -= NSEC_PER_SEC;
+                    }
+                    status = pthread_cond_timedwait (&output_ready, &output_mutex, &until);
+                    if (status == ETIMEDOUT)
+                        status = 0;
+                } else
+                    status = pthread_cond_wait (&output_ready, &output_mutex);
+                if (status != 0)
+                    err_abort (status, "Wait on output");
+            }
+            __atomic_store_n (&output_sleeping, 0, __ATOMIC_RELAXED);
+            output_unlock ();
+            idle = 0;
+            continue;
+        }
+        idle = 0;
+        slot = &output_ring[pos & (OUTPUT_SLOTS - 1)];
+        closing = slot->length == OUTPUT_CLOSE;
+        if (closing) {
+            backlog_close (slot->fd);
+            close (slot->fd);
+        } else
+            output_write (slot->fd, iov, count);
+        for (i = 0; i < count; i++) {
+            slot = &output_ring[(pos + i) & (OUTPUT_SLOTS - 1)];
+            free (slot->heap);
+            __atomic_store_n (&slot->sequence, pos + i + OUTPUT_SLOTS, __ATOMIC_SEQ_CST);
+        }
+        if (!closing)
+            __atomic_store_n (&output_lines, output_lines + count, __ATOMIC_RELAXED);
+        __atomic_store_n (&output_dequeue, pos + count, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&output_waiters, __ATOMIC_SEQ_CST) > 0) {
+            output_lock ();
+            status = pthread_cond_broadcast (&output_space);
+            if (status != 0)
+                err_abort (status, "Broadcast output space");
+            output_unlock ();
+        }
+    }
+}
+
+void output_start (int full)
+{
+    pthread_t thread;
+    uint64_t i;
+    int status;
+
+    output_ring = (slot_t*)calloc (OUTPUT_SLOTS, sizeof (slot_t));
+    if (output_ring == NULL)
+        errno_abort ("Allocate output ring");
+    for (i = 0; i < OUTPUT_SLOTS; i++)
+        output_ring[i].sequence = i;
+    output_full = full;
+    status = pthread_create (&thread, NULL, output_thread, NULL);
+    if (status != 0)
+        err_abort (status, "Create output thread");
+    pthread_detach (thread);
+}
+
+/*
+ * Claim the next slot and return its position, or return -1 if
+ * the ring is full.
+ */
+static int64_t output_claim (void)
+{
+    slot_t *slot;
+    uint64_t pos, sequence;
+
+    pos = __atomic_load_n (&output_enqueue, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &output_ring[pos & (OUTPUT_SLOTS - 1)];
+        sequence = __atomic_load_n (&slot->sequence, __ATOMIC_SEQ_CST);
+        if (sequence == pos) {
+            if (__atomic_compare_exchange_n (&output_enqueue, &pos, pos + 1,
+                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return pos;
+        } else if ((int64_t)(sequence - pos) < 0)
+            return -1;
+        else
+            pos = __atomic_load_n (&output_enqueue, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Wait for the writer to free a slot. Returns the claimed
+ * position.
+ */
+static int64_t output_wait (void)
+{
+    int64_t pos;
+    int status;
+
+    output_lock ();
+    __atomic_add_fetch (&output_waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&output_blocked, 1, __ATOMIC_RELAXED);
+    while ((pos = output_claim ()) < 0) {
+        status = pthread_cond_wait (&output_space, &output_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on output space");
+    }
+    __atomic_sub_fetch (&output_waiters, 1, __ATOMIC_SEQ_CST);
+    output_unlock ();
+    return pos;
+}
+
+/*
+ * Hand a filled slot to the writer, waking it if it may be
+ * asleep.
+ */
+static void output_publish (slot_t *slot, int64_t pos)
+{
+    int status;
+
+    __atomic_store_n (&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&output_sleeping, __ATOMIC_SEQ_CST)) {
+        output_lock ();
+        status = pthread_cond_signal (&output_ready);
+        if (status != 0)
+            err_abort (status, "Signal output");
+        output_unlock ();
+    }
+}
+
+void output_printf (int fd, const char *format, ...)
+{
+    va_list ap;
+
+    va_start (ap, format);
+    output_vprintf (fd, format, ap);
+    va_end (ap);
+}
+
+void output_vprintf (int fd, const char *format, va_list ap)
+{
+    va_list again;
+    slot_t *slot;
+    int64_t pos;
+    long lost = 0;
+    int length, note = 0;
+
+    pos = output_claim ();
+    if (pos < 0) {
+        if (output_full != OUTPUT_BLOCK) {
+            __atomic_add_fetch (&output_dropped, 1, __ATOMIC_RELAXED);
+            if (output_full == OUTPUT_COUNT)
+                __atomic_add_fetch (&output_lost, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        pos = output_wait ();
+    }
+    slot = &output_ring[pos & (OUTPUT_SLOTS - 1)];
+    slot->fd = fd;
+    slot->heap = NULL;
+    if (output_full == OUTPUT_COUNT
+            && __atomic_load_n (&output_lost, __ATOMIC_RELAXED) > 0) {
+        lost = __atomic_exchange_n (&output_lost, 0, __ATOMIC_RELAXED);
+        if (lost > 0)
+            note = snprintf (slot->text, OUTPUT_TEXT, "[%ld lines lost]\n", lost);
+    }
+    va_copy (again, ap);
+    length = vsnprintf (slot->text + note, OUTPUT_TEXT - note, format, ap);
+    if (note + length >= OUTPUT_TEXT) {
+        slot->heap = (char*)malloc (note + length + 1);
+        if (slot->heap == NULL)
+            errno_abort ("Allocate output line");
+        memcpy (slot->heap, slot->text, note);
+        vsnprintf (slot->heap + note, length + 1, format, again);
+    }
+    va_end (again);
+    slot->length = note + length;
+    output_publish (slot, pos);
+}
+
+/*
+ * The close has to wait for room even when lines would be
+ * dropped, or the descriptor would leak.
+ */
+void output_close (int fd)
+{
+    slot_t *slot;
+    int64_t pos;
+
+    pos = output_claim ();
+    if (pos < 0)
+        pos = output_wait ();
+    slot = &output_ring[pos & (OUTPUT_SLOTS - 1)];
+    slot->fd = fd;
+    slot->heap = NULL;
+    slot->length = OUTPUT_CLOSE;
+    output_publish (slot, pos);
+}
+
+void output_flush (void)
+{
+    slot_t *slot;
+    uint64_t target;
+    int64_t pos;
+    long lost;
+    int status;
+
+    /*
+     * Lines lost with no line after them to carry the note get
+     * one of their own, waiting for room if need be.
+     */
+    lost = __atomic_exchange_n (&output_lost, 0, __ATOMIC_RELAXED);
+    if (lost > 0) {
+        pos = output_claim ();
+        if (pos < 0)
+            pos = output_wait ();
+        slot = &output_ring[pos & (OUTPUT_SLOTS - 1)];
+        slot->fd = STDOUT_FILENO;
+        slot->heap = NULL;
+        slot->length = snprintf (slot->text, OUTPUT_TEXT, "[%ld lines lost]\n", lost);
+        output_publish (slot, pos);
+    }
+    target = __atomic_load_n (&output_enqueue, __ATOMIC_SEQ_CST);
+    output_lock ();
+    __atomic_add_fetch (&output_waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (&output_dequeue, __ATOMIC_SEQ_CST) < target) {
+        status = pthread_cond_wait (&output_space, &output_mutex);
+        if (status != 0)
+            err_abort (status, "Wait on output space");
+    }
+    __atomic_sub_fetch (&output_waiters, 1, __ATOMIC_SEQ_CST);
+    output_unlock ();
+}
+
+void output_report (FILE *file)
+{
+    fprintf (file, "Output: %ld lines in %ld writes, %ld dropped, %ld waits for room\n",
+        __atomic_load_n (&output_lines, __ATOMIC_RELAXED),
+        __atomic_load_n (&output_writes, __ATOMIC_RELAXED),
+        __atomic_load_n (&output_dropped, __ATOMIC_RELAXED),
+        __atomic_load_n (&output_blocked, __ATOMIC_RELAXED));
+}
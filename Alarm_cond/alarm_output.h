@@ -0,0 +1,55 @@
+#ifndef __alarm_output_h
+#define __alarm_output_h
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/*
+ * Asynchronous output. Lines are formatted by the calling thread
+ * into a lock-free ring and written out by a dedicated writer
+ * thread, which hands as many as it finds waiting to a single
+ * writev. No thread that schedules or delivers alarms ever waits
+ * on a terminal or a pipe, except as set by output_start:
+ *
+ *      OUTPUT_BLOCK    a full ring makes the caller wait for room
+ *      OUTPUT_DROP     a line that finds the ring full is lost
+ *      OUTPUT_COUNT    as OUTPUT_DROP, but a note of how many
+ *                      lines were lost goes out with the next line
+ *                      that fits
+ *
+ * Lines for different descriptors (standard output and standard
+ * error, and the sockets of clients, see alarm_server.h) go
+ * through the same ring, so they come out in the order they were
+ * made. A client's socket that is full never holds the writer up:
+ * its lines wait in a backlog of its own. A client that lets its
+ * backlog grow past OUTPUT_BACKLOG is disconnected and its lines
+ * dropped, as are lines for a peer that has gone.
+ */
+#define OUTPUT_BLOCK    0
+#define OUTPUT_DROP     1
+#define OUTPUT_COUNT    2
+
+void output_start (int full);
+
+/*
+ * Format a line and queue it for "fd". Any thread may call this.
+ */
+void output_printf (int fd, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+void output_vprintf (int fd, const char *format, va_list ap);
+
+/*
+ * Close "fd" once every line queued for it so far is written. No
+ * line may be queued for it after this, since the descriptor
+ * number may be reused.
+ */
+void output_close (int fd);
+
+/*
+ * Wait until everything queued before the call has been written.
+ */
+void output_flush (void);
+
+void output_report (FILE *file);
+
+#endif
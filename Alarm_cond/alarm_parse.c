@@ -0,0 +1,138 @@
+/*
+ * alarm_parse.c
+ *
+ * A hand-written scanner for the command grammar (see
+ * alarm_parse.h). Each scan_ routine takes a pointer into the line
+ * and returns a pointer just past what it matched, or NULL if the
+ * line does not match there.
+ */
+#include <stddef.h>
+#include <string.h>
+#include "alarm_parse.h"
+#include "alarm_time.h"
+
+#define IS_SPACE(c)     ((c) == ' ' || (c) == '\t' || (c) == '\r' \
+                            || (c) == '\n' || (c) == '\f' || (c) == '\v')
+#define IS_DIGIT(c)     ((c) >= '0' && (c) <= '9')
+
+static const char *scan_space (const char *p)
+{
+    while (IS_SPACE (*p))
+        p++;
+    return p;
+}
+
+static const char *scan_word (const char *p, const char *word, size_t length)
+{
+    if (strncmp (p, word, length) != 0)
+        return NULL;
+    return p + length;
+}
+
+/*
+ * A signed decimal int, after optional white space.
+ */
+static const char *scan_int (const char *p, int *value)
+{
+    long long n = 0;
+    int negative = 0;
+
+    p = scan_space (p);
+    if (*p == '-' || *p == '+')
+        negative = *p++ == '-';
+    if (!IS_DIGIT (*p))
+        return NULL;
+    while (IS_DIGIT (*p)) {
+        n = n * 10 + (*p++ - '0');
+        if (n > (long long)INT32_MAX + 1)
+            return NULL;
+    }
+    if (negative)
+        n = -n;
+    if (n > INT32_MAX)
+        return NULL;
+    *value = (int)n;
+    return p;
+}
+
+/*
+ * "Message(<number>)", after optional white space.
+ */
+static const char *scan_message (const char *p, int *number)
+{
+    p = scan_word (scan_space (p), "Message(", 8);
+    if (p == NULL || (p = scan_int (p, number)) == NULL)
+        return NULL;
+    p = scan_space (p);
+    return *p == ')' ? p + 1 : NULL;
+}
+
+/*
+ * "<duration>[~<duration>] Message(<number>) <text>", from the
+ * duration on.
+ */
+static int scan_set (const char *p, command_t *command)
+{
+    const char *end;
+
+    p = duration_parse (p, &command->interval);
+    if (p != NULL && *p == '~') {
+        if (!IS_DIGIT (p[1]))
+            return COMMAND_BAD;
+        p = duration_parse (p + 1, &command->slack);
+    }
+    if (p == NULL || *p == '~'
+            || (p = scan_message (p, &command->number)) == NULL)
+        return COMMAND_BAD;
+    p = scan_space (p);
+    end = p + strlen (p);
+    while (end > p && IS_SPACE (end[-1]))
+        end--;
+    if (end == p)
+        return COMMAND_BAD;
+    command->text = p;
+    command->length = end - p;
+    return command->verb = COMMAND_SET;
+}
+
+int command_scan (const char *line, command_t *command)
+{
+    const char *p, *end;
+
+    p = scan_space (line);
+    if (*p == '\0')
+        return command->verb = COMMAND_BLANK;
+    command->verb = COMMAND_BAD;
+    command->period = 0;
+    command->slack = -1;
+    if (IS_DIGIT (*p))
+        return scan_set (p, command);
+    if ((end = scan_word (p, "every", 5)) != NULL && IS_SPACE (*end)) {
+        p = scan_space (end);
+        if (!IS_DIGIT (*p) || scan_set (p, command) != COMMAND_SET)
+            return COMMAND_BAD;
+        if (command->interval <= 0)
+            return command->verb = COMMAND_BAD;
+        command->period = command->interval;
+        return COMMAND_SET;
+    }
+    if ((end = scan_word (p, "Stats", 5)) != NULL && *scan_space (end) == '\0')
+        return command->verb = COMMAND_STATS;
+    if ((end = scan_word (p, "List", 4)) != NULL && *scan_space (end) == '\0')
+        return command->verb = COMMAND_LIST;
+    if ((end = scan_word (p, "Query:", 6)) != NULL) {
+        if ((end = scan_message (end, &command->number)) == NULL)
+            return COMMAND_BAD;
+        if (*scan_space (end) != '\0')
+            return COMMAND_BAD;
+        return command->verb = COMMAND_QUERY;
+    }
+    if ((p = scan_word (p, "Cancel:", 7)) != NULL) {
+        if ((p = scan_message (p, &command->number)) == NULL)
+            return COMMAND_BAD;
+        if (*scan_space (p) != '\0')
+            return COMMAND_BAD;
+        return command->verb = COMMAND_CANCEL;
+    }
+    return COMMAND_BAD;
+}
@@ -0,0 +1,59 @@
+#ifndef __alarm_parse_h
+#define __alarm_parse_h
+
+#include <stdint.h>
+
+/*
+ * The command grammar:
+ *
+ *      <duration> Message(<number>) <text>     set, or replace the
+ *                                              pending alarm with
+ *                                              the same number
+ *      every <duration> Message(<number>) <text>
+ *                                              the same, but the
+ *                                              alarm fires every
+ *                                              <duration> until it
+ *                                              is cancelled
+ *      Cancel: Message(<number>)               cancel
+ *      Stats                                   print the runtime
+ *                                              statistics
+ *      List                                    print every pending
+ *                                              alarm
+ *      Query: Message(<number>)                print one pending
+ *                                              alarm
+ *
+ * where <duration> is as for duration_parse (see alarm_time.h)
+ * and <text> is the rest of the line. White space may surround
+ * each element. The <duration> of a set may be followed, with no
+ * space, by "~<duration>": the slack, how much later than its
+ * deadline the alarm may fire (see deadline_slack).
+ *
+ * command_scan makes one pass over a line, allocates nothing and
+ * copies nothing: "text" points into the line itself, so it stays
+ * valid only as long as the line does.
+ */
+#define COMMAND_BLANK   0               /* empty or white space */
+#define COMMAND_BAD     1
+#define COMMAND_SET     2
+#define COMMAND_CANCEL  3
+#define COMMAND_STATS   4
+#define COMMAND_LIST    5
+#define COMMAND_QUERY   6
+
+typedef struct command_tag {
+    int                 verb;           /* COMMAND_* */
+    int                 number;         /* Message(<number>) */
+    int64_t             interval;       /* nsec, for COMMAND_SET */
+    int64_t             period;         /* "interval" if "every", or 0 */
+    int64_t             slack;          /* after "~", or -1 */
+    const char          *text;          /* message, for COMMAND_SET */
+    int                 length;         /* of "text" */
+} command_t;
+
+/*
+ * Scan the NUL-terminated "line" (which may end in a newline) into
+ * "command", and return command->verb.
+ */
+int command_scan (const char *line, command_t *command);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * alarm_pool.c
+ *
+ * Slab allocator for alarm_t.
+ *
+ * A slab is a SLAB_SIZE block aligned on its own size: a small
+ * header followed by as many alarms as fit. The alignment means
+ * the slab that owns an alarm is found by masking the alarm's
+ * address. Free alarms in a slab are chained through "link".
+ *
+ * Each thread has a cache of up to CACHE_SIZE free alarms. An
+ * empty cache is refilled with CACHE_BATCH alarms, and a full one
+ * gives CACHE_BATCH back to their owning slabs, each under a
+ * single acquisition of pool_mutex. Alarms usually expire on a
+ * different thread from the one that created them, so the cache
+ * of a thread that only frees (the alarm thread) keeps flowing
+ * back to the slabs rather than growing. A thread's cache is
+ * returned to the slabs when the thread exits.
+ *
+ * Each cache also counts its own allocations and frees. They are
+ * only ever written by the owning thread (with relaxed atomic
+ * stores, so pool_stats can read them), which keeps the hot path
+ * free of shared read-modify-write operations.
+ *
+ * Slabs are never given back to the system; the pool stays at the
+ * size of the largest number of alarms pending at once.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "alarm_pool.h"
+#include "alarm_arena.h"
+#include "errors.h"
+
+#define SLAB_SIZE       (64 * 1024)
+#define CACHE_SIZE      64
+#define CACHE_BATCH     32
+
+typedef struct slab_tag {
+    struct slab_tag     *next;          /* on pool_partial list */
+    int                 on_partial;
+    int                 free_count;
+    alarm_t             *free_list;
+} slab_t;
+
+typedef struct cache_tag {
+    struct cache_tag    *next;          /* on pool_caches list */
+    struct cache_tag    **back;
+    long                allocs;
+    long                frees;
+    int                 registered;     /* only the owner looks */
+    int                 count;
+    alarm_t             *item[CACHE_SIZE];
+} cache_t;
+
+#define SLAB_FIRST      ((sizeof (slab_t) + sizeof (alarm_t) - 1) \
+                            / sizeof (alarm_t))
+#define SLAB_ALARMS     (SLAB_SIZE / sizeof (alarm_t) - SLAB_FIRST)
+#define SLAB_OF(alarm)  ((slab_t*)((uintptr_t)(alarm) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static slab_t *pool_partial = NULL;     /* slabs with free alarms */
+static long pool_slabs = 0;
+static long pool_free = 0;
+static cache_t *pool_caches = NULL;     /* caches of live threads */
+static long pool_allocs = 0;            /* totals of exited threads */
+static long pool_frees = 0;
+
+static __thread cache_t pool_cache;
+
+/*
+ * Allocate a slab and chain all its alarms onto its free list.
+ * The caller must have locked pool_mutex.
+ */
+static slab_t *slab_create (void)
+{
+    slab_t *slab;
+    alarm_t *alarms;
+    void *block;
+    int i, status;
+
+    status = posix_memalign (&block, SLAB_SIZE, SLAB_SIZE);
+    if (status != 0)
+        err_abort (status, "Allocate slab");
+    slab = (slab_t*)block;
+    alarms = (alarm_t*)block + SLAB_FIRST;
+    slab->free_list = NULL;
+    for (i = SLAB_ALARMS - 1; i >= 0; i--) {
+        alarms[i].link = slab->free_list;
+        slab->free_list = &alarms[i];
+    }
+    slab->free_count = SLAB_ALARMS;
+    slab->next = pool_partial;
+    slab->on_partial = 1;
+    pool_partial = slab;
+    pool_slabs++;
+    pool_free += SLAB_ALARMS;
+    return slab;
+}
+
+/*
+ * Give every alarm in the cache back to its slab.
+ */
+static void cache_flush (cache_t *cache, int count)
+{
+    slab_t *slab;
+    alarm_t *alarm;
+    int status;
+
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool");
+    while (count-- > 0) {
+        alarm = cache->item[--cache->count];
+        slab = SLAB_OF (alarm);
+        alarm->link = slab->free_list;
+        slab->free_list = alarm;
+        slab->free_count++;
+        if (!slab->on_partial) {
+            slab->next = pool_partial;
+            slab->on_partial = 1;
+            pool_partial = slab;
+        }
+        pool_free++;
+    }
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool");
+}
+
+/*
+ * Called as a thread exits, with its cache.
+ */
+static void cache_destroy (void *arg)
+{
+    cache_t *cache = (cache_t*)arg;
+    int status;
+
+    cache_flush (cache, cache->count);
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool");
+    *cache->back = cache->next;
+    if (cache->next != NULL)
+        cache->next->back = cache->back;
+    pool_allocs += cache->allocs;
+    pool_frees += cache->frees;
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool");
+}
+
+static void pool_init (void)
+{
+    int status;
+
+    status = pthread_key_create (&pool_key, cache_destroy);
+    if (status != 0)
+        err_abort (status, "Create pool key");
+}
+
+/*
+ * The first time a thread uses the pool, put its cache on the
+ * pool_caches list and arrange for cache_destroy to run when the
+ * thread exits.
+ */
+static void cache_register (cache_t *cache)
+{
+    int status;
+
+    status = pthread_once (&pool_once, pool_init);
+    if (status != 0)
+        err_abort (status, "Init pool");
+    status = pthread_setspecific (pool_key, cache);
+    if (status != 0)
+        err_abort (status, "Set pool key");
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool");
+    cache->next = pool_caches;
+    if (cache->next != NULL)
+        cache->next->back = &cache->next;
+    cache->back = &pool_caches;
+    pool_caches = cache;
+    cache->registered = 1;
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool");
+}
+
+static void cache_refill (cache_t *cache)
+{
+    slab_t *slab;
+    int status;
+
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool");
+    while (cache->count < CACHE_BATCH) {
+        slab = pool_partial;
+        if (slab == NULL)
+            slab = slab_create ();
+        cache->item[cache->count++] = slab->free_list;
+        slab->free_list = slab->free_list->link;
+        pool_free--;
+        if (--slab->free_count == 0) {
+            pool_partial = slab->next;
+            slab->on_partial = 0;
+        }
+    }
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool");
+}
+
+alarm_t *alarm_alloc (size_t length)
+{
+    cache_t *cache = &pool_cache;
+    alarm_t *alarm;
+
+    if (!cache->registered)
+        cache_register (cache);
+    if (cache->count == 0)
+        cache_refill (cache);
+    __atomic_store_n (&cache->allocs, cache->allocs + 1, __ATOMIC_RELAXED);
+    alarm = cache->item[--cache->count];
+    alarm->refs = 1;
+    alarm->body = body_alloc (length);
+    return alarm;
+}
+
+void alarm_free (alarm_t *alarm)
+{
+    cache_t *cache = &pool_cache;
+
+    if (!cache->registered)
+        cache_register (cache);
+    if (alarm->body != NULL)
+        body_free (alarm->body);
+    __atomic_store_n (&cache->frees, cache->frees + 1, __ATOMIC_RELAXED);
+    if (cache->count == CACHE_SIZE)
+        cache_flush (cache, CACHE_BATCH);
+    cache->item[cache->count++] = alarm;
+}
+
+/*
+ * A sole holder (every one-shot alarm) frees without an atomic
+ * read-modify-write.
+ */
+void alarm_release (alarm_t *alarm)
+{
+    if (__atomic_load_n (&alarm->refs, __ATOMIC_ACQUIRE) == 1
+            || __atomic_sub_fetch (&alarm->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        alarm_free (alarm);
+}
+
+/*
+ * The per-thread counts are read while their threads keep
+ * running, so in_use and cached are a close approximation rather
+ * than an instantaneous snapshot.
+ */
+void pool_stats (pool_stats_t *stats)
+{
+    cache_t *cache;
+    long allocs, frees;
+    int status;
+
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Lock pool");
+    allocs = pool_allocs;
+    frees = pool_frees;
+    for (cache = pool_caches; cache != NULL; cache = cache->next) {
+        allocs += __atomic_load_n (&cache->allocs, __ATOMIC_RELAXED);
+        frees += __atomic_load_n (&cache->frees, __ATOMIC_RELAXED);
+    }
+    stats->slabs = pool_slabs;
+    stats->capacity = pool_slabs * SLAB_ALARMS;
+    stats->bytes = pool_slabs * SLAB_SIZE;
+    stats->free = pool_free;
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock pool");
+    stats->in_use = allocs - frees;
+    stats->cached = stats->capacity - stats->free - stats->in_use;
+}
@@ -0,0 +1,45 @@
+#ifndef __alarm_pool_h
+#define __alarm_pool_h
+
+#include "alarm.h"
+
+/*
+ * A fixed-size slab allocator for alarm_t. Alarms are carved out
+ * of SLAB_SIZE blocks, and each thread keeps a small cache of free
+ * alarms, so that scheduling and expiring an alarm usually costs a
+ * couple of array operations instead of a malloc and a free. Any
+ * thread may free an alarm that another thread allocated.
+ *
+ * alarm_alloc also takes a body (see alarm.h) with room for a
+ * message of "length" bytes from the arena, and sets its "length";
+ * alarm_free gives the body back, if the alarm still has one.
+ *
+ * Unlike the queue and the index, the pool does its own locking.
+ */
+alarm_t *alarm_alloc (size_t length);
+void alarm_free (alarm_t *alarm);
+
+/*
+ * Drop one reference to an alarm (see alarm.h), and free it if
+ * that was the last.
+ */
+void alarm_release (alarm_t *alarm);
+
+/*
+ * Pool occupancy. "capacity" is the number of alarms the slabs
+ * can hold (in "bytes"), "free" how many of those sit unused in the slabs,
+ * "cached" how many sit unused in per-thread caches, and "in_use"
+ * how many have been handed out by alarm_alloc and not yet freed.
+ */
+typedef struct pool_stats_tag {
+    long                slabs;
+    long                capacity;
+    long                bytes;
+    long                free;
+    long                cached;
+    long                in_use;
+} pool_stats_t;
+
+void pool_stats (pool_stats_t *stats);
+
+#endif
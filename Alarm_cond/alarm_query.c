@@ -0,0 +1,273 @@
+/*
+ * alarm_query.c
+ *
+ * The reader threads. Requests wait in a FIFO list protected by
+ * query_mutex, and idle readers wait on query_ready for them.
+ * "query_busy" counts the requests taken but not yet answered, and
+ * query_flush waits on query_done for both to run out. Each request
+ * holds the clock (see alarm_clock.h) until it is answered, so that
+ * a virtual clock does not run on under a List.
+ *
+ * A List walks each shard's index in turn, inside an epoch (see
+ * alarm_epoch.h), copying every pending alarm into a listing (the
+ * texts go into one growing buffer, so a listing of millions of
+ * alarms costs a handful of allocations), then sorts the whole
+ * listing by deadline and prints it. The walk takes no lock. Before
+ * it, and before a Query looks an alarm up, the shard's mutex is
+ * held just long enough to apply the commands still waiting in its
+ * submit queue (see shard_sync), so that the answer covers every
+ * command read before the List or Query.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "alarm_query.h"
+#include "alarm_shard.h"
+#include "alarm_epoch.h"
+#include "alarm_parse.h"
+#include "alarm_server.h"
+#include "alarm_time.h"
+#include "alarm_clock.h"
+#include "errors.h"
+
+typedef struct request_tag {
+    struct request_tag  *next;
+    int                 client;
+    int                 verb;           /* COMMAND_LIST or _QUERY */
+    int                 number;
+} request_t;
+
+/*
+ * A pending alarm, as copied out of the index.
+ */
+typedef struct entry_tag {
+    int64_t             deadline;
+    int64_t             interval;
+    int64_t             period;
+    int64_t             slack;
+    size_t              text;           /* offset in listing "text" */
+    int                 length;
+    int                 number;
+} entry_t;
+
+typedef struct listing_tag {
+    entry_t             *entry;
+    size_t              count;
+    size_t              size;
+    char                *text;
+    size_t              length;
+    size_t              room;
+} listing_t;
+
+static pthread_mutex_t query_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t query_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t query_done = PTHREAD_COND_INITIALIZER;
+static int query_busy = 0;
+static request_t *query_first = NULL;
+static request_t **query_last = &query_first;
+
+static void listing_add (alarm_t *alarm, void *arg)
+{
+    listing_t *listing = (listing_t*)arg;
+    entry_t *entry;
+
+    if (listing->count == listing->size) {
+        listing->size = listing->size < 64 ? 64 : listing->size * 2;
+        listing->entry = (entry_t*)realloc (listing->entry,
+            listing->size * sizeof (entry_t));
+        if (listing->entry == NULL)
+            errno_abort ("Allocate listing");
+    }
+    if (listing->length + alarm->body->length > listing->room) {
+        do
+            listing->room = listing->room < 4096 ? 4096 : listing->room * 2;
+        while (listing->length + alarm->body->length > listing->room);
+        listing->text = (char*)realloc (listing->text, listing->room);
+        if (listing->text == NULL)
+            errno_abort ("Allocate listing");
+    }
+    entry = &listing->entry[listing->count++];
+    entry->deadline = __atomic_load_n (&alarm->body->deadline, __ATOMIC_RELAXED);
+    entry->interval = alarm->body->interval;
+    entry->period = alarm->period;
+    entry->slack = alarm->body->slack;
+    entry->number = alarm->Message_Number;
+    entry->length = alarm->body->length;
+    entry->text = listing->length;
+    memcpy (listing->text + listing->length, alarm->body->message,
+        alarm->body->length);
+    listing->length += alarm->body->length;
+}
+
+static int entry_compare (const void *a, const void *b)
+{
+    const entry_t *x = (const entry_t*)a, *y = (const entry_t*)b;
+
+    if (x->deadline != y->deadline)
+        return x->deadline < y->deadline ? -1 : 1;
+    return x->number < y->number ? -1 : x->number > y->number;
+}
+
+/*
+ * Print an alarm much as it was acknowledged, with the time left
+ * until its deadline.
+ */
+static void entry_print (int client, const char *prefix, entry_t *entry,
+    const char *text, int64_t now)
+{
+    char interval[32], slack[40] = "";
+
+    duration_format (entry->interval, interval, sizeof (interval));
+    if (entry->slack != 0) {
+        slack[0] = '~';
+        duration_format (entry->slack, slack + 1, sizeof (slack) - 1);
+    }
+    client_printf (client, STDOUT_FILENO, "%sMessage(%d) <%s%s%s %.*s> due in %.3fs\n",
+        prefix, entry->number, entry->period != 0 ? "every " : "",
+        interval, slack, entry->length, text,
+        (double)(entry->deadline - now) / NSEC_PER_SEC);
+}
+
+static void query_one (int client, int number)
+{
+    shard_t *shard = shard_for (number);
+    listing_t listing;
+    alarm_t *alarm;
+
+    memset (&listing, 0, sizeof (listing));
+    shard_sync (shard);
+    epoch_enter ();
+    alarm = index_find (shard->index, number);
+    if (alarm != NULL)
+        listing_add (alarm, &listing);
+    epoch_exit ();
+    epoch_collect ();
+    if (listing.count == 0)
+        client_printf (client, STDERR_FILENO, "No alarm with Message(%d)\n", number);
+    else
+        entry_print (client, "Query: ", &listing.entry[0], listing.text, alarm_now ());
+    free (listing.entry);
+    free (listing.text);
+}
+
+static void query_list (int client)
+{
+    listing_t listing;
+    shard_t *shard;
+    int64_t now;
+    size_t i;
+
+    memset (&listing, 0, sizeof (listing));
+    for (shard = shards; shard < shards + shard_count; shard++)
+        shard_scan (shard, listing_add, &listing);
+    qsort (listing.entry, listing.count, sizeof (entry_t), entry_compare);
+    now = alarm_now ();
+    client_printf (client, STDOUT_FILENO, "List at <%ld>: %ld pending\n",
+        (long)alarm_time (), (long)listing.count);
+    for (i = 0; i < listing.count; i++)
+        entry_print (client, "  ", &listing.entry[i],
+            listing.text + listing.entry[i].text, now);
+    free (listing.entry);
+    free (listing.text);
+}
+
+/*
+ * The reader threads' start routine.
+ */
+static void *query_thread (void *arg)
+{
+    request_t *request;
+    int status;
+
+    while (1) {
+        status = pthread_mutex_lock (&query_mutex);
+        if (status != 0)
+            err_abort (status, "Lock query");
+        while (query_first == NULL) {
+            status = pthread_cond_wait (&query_ready, &query_mutex);
+            if (status != 0)
+                err_abort (status, "Wait on query");
+        }
+        request = query_first;
+        query_first = request->next;
+        if (query_first == NULL)
+            query_last = &query_first;
+        query_busy++;
+        status = pthread_mutex_unlock (&query_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock query");
+        if (request->verb == COMMAND_LIST)
+            query_list (request->client);
+        else
+            query_one (request->client, request->number);
+        free (request);
+        clock_release (1);
+        status = pthread_mutex_lock (&query_mutex);
+        if (status != 0)
+            err_abort (status, "Lock query");
+        if (--query_busy == 0 && query_first == NULL) {
+            status = pthread_cond_broadcast (&query_done);
+            if (status != 0)
+                err_abort (status, "Broadcast query");
+        }
+        status = pthread_mutex_unlock (&query_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock query");
+    }
+}
+
+void query_start (int readers)
+{
+    pthread_t thread;
+    int i, status;
+
+    for (i = 0; i < readers; i++) {
+        status = pthread_create (&thread, NULL, query_thread, NULL);
+        if (status != 0)
+            err_abort (status, "Create reader thread");
+        pthread_detach (thread);
+    }
+}
+
+void query_submit (int client, int verb, int number)
+{
+    request_t *request;
+    int status;
+
+    request = (request_t*)malloc (sizeof (request_t));
+    if (request == NULL)
+        errno_abort ("Allocate query");
+    request->next = NULL;
+    request->client = client;
+    request->verb = verb;
+    request->number = number;
+    clock_hold (1);
+    status = pthread_mutex_lock (&query_mutex);
+    if (status != 0)
+        err_abort (status, "Lock query");
+    *query_last = request;
+    query_last = &request->next;
+    status = pthread_cond_signal (&query_ready);
+    if (status != 0)
+        err_abort (status, "Signal query");
+    status = pthread_mutex_unlock (&query_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock query");
+}
+
+void query_flush (void)
+{
+    int status;
+
+    status = pthread_mutex_lock (&query_mutex);
+    if (status != 0)
+        err_abort (status, "Lock query");
+    while (query_first != NULL || query_busy > 0) {
+        status = pthread_cond_wait (&query_done, &query_mutex);
+        if (status != 0)
+            err_abort (status, "Wait for query");
+    }
+    status = pthread_mutex_unlock (&query_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock query");
+}
@@ -0,0 +1,31 @@
+#ifndef __alarm_query_h
+#define __alarm_query_h
+
+/*
+ * The read-only commands, "List" and "Query: Message(n)" (see
+ * alarm_parse.h), are answered by a pool of reader threads rather
+ * than by the thread that read them, so that a long listing holds
+ * up neither input nor the alarm threads.
+ *
+ * A reader looks at a shard's pending alarms without any lock (see
+ * alarm_shard.h), so any number of readers work at once, on the
+ * same shard or on different ones, while the alarm thread goes on
+ * firing and changing them. What a reader finds is copied out, and
+ * printed once it has finished looking.
+ */
+void query_start (int readers);
+
+/*
+ * Queue a List (COMMAND_LIST) or a Query (COMMAND_QUERY of
+ * Message_Number "number") from "client" for the readers. The
+ * answer goes back to the client, like an acknowledgement.
+ */
+void query_submit (int client, int verb, int number);
+
+/*
+ * Wait until every List and Query submitted so far has been
+ * answered.
+ */
+void query_flush (void);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __alarm_queue_h
+#define __alarm_queue_h
+
+#include "alarm.h"
+
+/*
+ * The pending-alarm queue. Exactly one implementation is linked
+ * into the program (the Makefile's QUEUE variable picks it):
+ *
+ *      alarm_wheel.c   hierarchical timing wheel (default)
+ *      alarm_heap.c    indexed 4-ary min-heap
+ *      alarm_list.c    the original sorted linked list
+ *
+ * LOCKING PROTOCOL:
+ *
+ * None of these routines lock anything. Each shard's queue is only
+ * used by that shard's alarm thread (see alarm_shard.h).
+ */
+typedef struct queue_tag queue_t;
+
+queue_t *queue_create (void);
+
+/*
+ * Free an empty queue.
+ */
+void queue_destroy (queue_t *queue);
+
+/*
+ * Add an alarm. Its "time" member must already be set.
+ */
+void queue_insert (queue_t *queue, alarm_t *alarm);
+
+/*
+ * Take a pending alarm out of the queue (it must be in it).
+ */
+void queue_remove (queue_t *queue, alarm_t *alarm);
+
+/*
+ * Reposition a pending alarm after its "time" member has been
+ * changed in place.
+ */
+void queue_update (queue_t *queue, alarm_t *alarm);
+
+/*
+ * Non-zero if no alarm is pending.
+ */
+int queue_empty (queue_t *queue);
+
+/*
+ * The time at which the alarm thread next has work to do. This is
+ * never later than the earliest pending alarm, but it may be
+ * earlier (the wheel also has to wake up to cascade its upper
+ * levels). Only meaningful if the queue is not empty.
+ */
+int64_t queue_next (queue_t *queue);
+
+/*
+ * Detach every alarm whose time is at or before "now" in one step
+ * and return them as a list chained through "link" (NULL if none
+ * is due yet). The list is in time order.
+ */
+alarm_t *queue_expire (queue_t *queue, int64_t now);
+
+#ifdef DEBUG
+void queue_dump (queue_t *queue);
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * alarm_server.c
+ *
+ * The socket front end (see alarm_server.h). One thread, the one
+ * that calls server_run, accepts connections and reads commands,
+ * with every socket non-blocking and registered with one epoll
+ * instance, so a thousand idle clients cost nothing but their
+ * buffers.
+ *
+ * A client id is its slot in server_clients and the slot's
+ * generation: (generation << 16) | slot. The generation changes
+ * each time the slot is given out, so an alarm outliving its
+ * client cannot reach the slot's next occupant.
+ *
+ * Other threads find a client's socket through client_printf,
+ * under server_mutex. A client is only taken out of the table
+ * under server_mutex, and its socket is then closed through the
+ * output ring (output_close), after any line already queued for
+ * it, so no line is ever written to a descriptor number that has
+ * been reused.
+ */
+#define _GNU_SOURCE                     /* for accept4 */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "alarm_server.h"
+#include "alarm_output.h"
+#include "alarm_clock.h"
+#include "errors.h"
+
+#define CLIENT_LINE     4096            /* longest command line */
+#define SERVER_EVENTS   256             /* epoll events per wait */
+#define EVENT_LISTEN    UINT32_MAX      /* epoll data of the listener */
+#define EVENT_SIGNAL    (UINT32_MAX - 1)
+
+typedef struct client_tag {
+    int                 id;
+    int                 fd;
+    int                 held;           /* bytes in "line" */
+    int                 skipping;       /* rest of an overlong line */
+    char                line[CLIENT_LINE];
+} client_t;
+
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+static client_t *server_clients[SERVER_CLIENTS];
+static unsigned short server_generation[SERVER_CLIENTS];
+static int server_free[SERVER_CLIENTS]; /* free slots, a stack */
+static int server_free_count;
+static const char *server_path;
+static int server_fd;
+static int server_epoll;
+static int server_signals;
+
+void client_printf (int client, int fd, const char *format, ...)
+{
+    client_t *target;
+    va_list ap;
+    int status;
+
+    va_start (ap, format);
+    if (client == 0) {
+        output_vprintf (fd, format, ap);
+        va_end (ap);
+        return;
+    }
+    status = pthread_mutex_lock (&server_mutex);
+    if (status != 0)
+        err_abort (status, "Lock server");
+    target = server_clients[client & 0xffff];
+    if (target != NULL && target->id == client)
+        output_vprintf (target->fd, format, ap);
+    status = pthread_mutex_unlock (&server_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock server");
+    va_end (ap);
+}
+
+void server_start (const char *path)
+{
+    struct sockaddr_un address;
+    struct epoll_event event;
+    struct rlimit limit;
+    sigset_t quit;
+    int i;
+
+    if (strlen (path) >= sizeof (address.sun_path)) {
+        fprintf (stderr, "Socket path too long: %s\n", path);
+        exit (1);
+    }
+    /*
+     * Each client needs a descriptor, so allow as many as the
+     * hard limit does.
+     */
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &limit);
+    }
+    signal (SIGPIPE, SIG_IGN);
+    sigemptyset (&quit);
+    sigaddset (&quit, SIGINT);
+    sigaddset (&quit, SIGTERM);
+    if (sigprocmask (SIG_BLOCK, &quit, NULL) == -1)
+        errno_abort ("Block signals");
+    server_signals = signalfd (-1, &quit, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server_signals == -1)
+        errno_abort ("Create signalfd");
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy (address.sun_path, path);
+    server_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd == -1)
+        errno_abort ("Create socket");
+    unlink (path);
+    if (bind (server_fd, (struct sockaddr*)&address, sizeof (address)) == -1)
+        errno_abort ("Bind socket");
+    if (listen (server_fd, SOMAXCONN) == -1)
+        errno_abort ("Listen on socket");
+    server_path = path;
+
+    server_epoll = epoll_create1 (EPOLL_CLOEXEC);
+    if (server_epoll == -1)
+        errno_abort ("Create epoll");
+    event.events = EPOLLIN;
+    event.data.u32 = EVENT_LISTEN;
+    if (epoll_ctl (server_epoll, EPOLL_CTL_ADD, server_fd, &event) == -1)
+        errno_abort ("Add listener to epoll");
+    event.data.u32 = EVENT_SIGNAL;
+    if (epoll_ctl (server_epoll, EPOLL_CTL_ADD, server_signals, &event) == -1)
+        errno_abort ("Add signalfd to epoll");
+    for (i = 0; i < SERVER_CLIENTS; i++)
+        server_free[i] = SERVER_CLIENTS - 1 - i;
+    server_free_count = SERVER_CLIENTS;
+}
+
+/*
+ * Take every connection waiting on the listener.
+ */
+static void server_accept (void)
+{
+    struct epoll_event event;
+    client_t *client;
+    int fd, slot, status;
+
+    while ((fd = accept4 (server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (server_free_count == 0) {
+            close (fd);
+            continue;
+        }
+        client = (client_t*)malloc (sizeof (client_t));
+        if (client == NULL)
+            errno_abort ("Allocate client");
+        slot = server_free[--server_free_count];
+        if (++server_generation[slot] >= 0x8000)
+            server_generation[slot] = 1;
+        client->id = (server_generation[slot] << 16) | slot;
+        client->fd = fd;
+        client->held = 0;
+        client->skipping = 0;
+        event.events = EPOLLIN;
+        event.data.u32 = slot;
+        if (epoll_ctl (server_epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+            errno_abort ("Add client to epoll");
+        status = pthread_mutex_lock (&server_mutex);
+        if (status != 0)
+            err_abort (status, "Lock server");
+        server_clients[slot] = client;
+        status = pthread_mutex_unlock (&server_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock server");
+    }
+    if (errno != EAGAIN && errno != ECONNABORTED && errno != EINTR)
+        errno_abort ("Accept client");
+}
+
+static void server_drop (int slot)
+{
+    client_t *client = server_clients[slot];
+    int status;
+
+    epoll_ctl (server_epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    status = pthread_mutex_lock (&server_mutex);
+    if (status != 0)
+        err_abort (status, "Lock server");
+    server_clients[slot] = NULL;
+    status = pthread_mutex_unlock (&server_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock server");
+    output_close (client->fd);
+    free (client);
+    server_free[server_free_count++] = slot;
+}
+
+/*
+ * Read what the client has sent and pass on each complete line. A
+ * line too long for the buffer is a bad command, as in batch mode.
+ */
+static void server_read (int slot, void (*command) (int client, const char *line))
+{
+    client_t *client = server_clients[slot];
+    char *line, *end, *newline;
+    ssize_t got;
+
+    got = read (client->fd, client->line + client->held,
+        CLIENT_LINE - 1 - client->held);
+    if (got == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (got <= 0) {
+        if (client->held > 0 && !client->skipping) {
+            client->line[client->held] = '\0';
+            command (client->id, client->line);
+        }
+        server_drop (slot);
+        return;
+    }
+    client->held += got;
+    end = client->line + client->held;
+    line = client->line;
+    while ((newline = memchr (line, '\n', end - line)) != NULL) {
+        *newline = '\0';
+        if (client->skipping)
+            client->skipping = 0;
+        else
+            command (client->id, line);
+        line = newline + 1;
+    }
+    client->held = end - line;
+    if (client->held == CLIENT_LINE - 1) {
+        if (!client->skipping)
+            client_printf (client->id, STDERR_FILENO, "Bad command\n");
+        client->skipping = 1;
+        client->held = 0;
+    } else
+        memmove (client->line, line, client->held);
+}
+
+void server_run (void (*command) (int client, const char *line),
+    void (*flush) (void), void (*quit) (void))
+{
+    struct epoll_event events[SERVER_EVENTS];
+    int count, i;
+
+    while (1) {
+        /*
+         * Let a virtual clock run only while there is nothing to
+         * read (see alarm_clock.h).
+         */
+        count = epoll_wait (server_epoll, events, SERVER_EVENTS, 0);
+        if (count == 0) {
+            clock_release (1);
+            count = epoll_wait (server_epoll, events, SERVER_EVENTS, -1);
+            clock_hold (1);
+        }
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Wait on epoll");
+        }
+        for (i = 0; i < count; i++) {
+            if (events[i].data.u32 == EVENT_LISTEN)
+                server_accept ();
+            else if (events[i].data.u32 == EVENT_SIGNAL) {
+                flush ();
+                unlink (server_path);
+                quit ();
+            } else if (server_clients[events[i].data.u32] != NULL)
+                server_read (events[i].data.u32, command);
+        }
+        flush ();
+    }
+}
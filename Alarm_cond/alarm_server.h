@@ -0,0 +1,46 @@
+#ifndef __alarm_server_h
+#define __alarm_server_h
+
+/*
+ * The Unix domain socket front end. Any number of local clients
+ * connect to the socket and send commands in the usual grammar
+ * (see alarm_parse.h), one per line. Each client gets back the
+ * acknowledgements of its own commands and the expiry of the
+ * alarms it set (or last replaced); nothing of theirs goes to
+ * standard output.
+ *
+ * Every alarm and every command carries the id of the client it
+ * came from in "client" (see alarm.h); 0 stands for standard
+ * input and output. Ids are not reused for a long time, so output
+ * for a client that has gone is dropped rather than sent to a
+ * newcomer that happens to get its descriptor.
+ */
+#define SERVER_CLIENTS  65536           /* most connected at once */
+
+/*
+ * Create the socket at "path" (replacing any old one) and block
+ * SIGINT and SIGTERM, which server_run then takes as the signal to
+ * quit. Must be called before any other thread is started, so
+ * that they all inherit the blocked signals.
+ */
+void server_start (const char *path);
+
+/*
+ * Serve clients until SIGINT or SIGTERM arrives, then remove the
+ * socket and call "quit", which must not return. "command" is
+ * called with each line received and the client it came from;
+ * "flush" is called after each round of lines, so that "command"
+ * can collect the commands it makes and submit them together.
+ */
+void server_run (void (*command) (int client, const char *line),
+    void (*flush) (void), void (*quit) (void));
+
+/*
+ * Format a line for "client", or for "fd" (STDOUT_FILENO or
+ * STDERR_FILENO) if "client" is 0. Any thread may call this. A
+ * line for a client that has disconnected is dropped.
+ */
+void client_printf (int client, int fd, const char *format, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * alarm_shard.c
+ *
+ * The sharded alarm engine: per-shard alarm threads and the
+ * routines that change a shard's pending alarms.
+ *
+ * Each alarm thread waits on its shard's timing engine (see
+ * alarm_engine.h), through the clock (see alarm_clock.h), with a
+ * timeout that corresponds to the earliest timer request on the
+ * shard. If main enters an earlier timeout on that shard, it wakes
+ * the engine so that the alarm thread will wake up and process the
+ * earlier timeout first.
+ *
+ * Commands reach the alarm thread through the shard's MPSC queue
+ * (see alarm_mpsc.h) and are applied in batches, each time the
+ * thread wakes. shard_submit only wakes the thread (with
+ * clock_wake) when the command has to be looked at before
+ * current_alarm: when it sets an earlier deadline, or when nothing
+ * would wake the thread within SUBMIT_LATENCY to apply it. A burst
+ * of commands therefore costs at most one wakeup per
+ * SUBMIT_LATENCY, however many threads submit them.
+ *
+ * No command can be missed by a thread going to sleep: the thread
+ * publishes current_alarm and then looks at the submit queue, and
+ * shard_submit pushes and then looks at current_alarm, both with
+ * sequentially consistent operations, so at least one of them sees
+ * the other.
+ *
+ * When the alarm thread wakes, it takes every alarm that is due
+ * in one go and delivers the batch after releasing the mutex, so
+ * thousands of alarms sharing a deadline cost one wakeup rather
+ * than thousands. Alarms with slack (see alarm.h) are queued for
+ * a time picked inside their window, so alarms whose deadlines are
+ * spread out but whose windows overlap fall due together as well.
+ *
+ * A periodic alarm stays in the queue and the index when it fires:
+ * it is chained into the batch through "batch" rather than "link",
+ * and re-armed at its last deadline plus its period (with its
+ * slack applied afresh). If it was missed for several periods (the
+ * process was stopped, or it was loaded overdue), it fires once
+ * and skips to the first deadline still ahead, keeping its phase.
+ * If that deadline would not fit in 64 bits (the period is
+ * centuries long), it fires for the last time and is dropped like
+ * a one-shot alarm. If its previous firing is still waiting for a
+ * dispatcher, it is not queued again: that firing is coalesced
+ * with the new one.
+ *
+ * Reader threads look at the index and its alarms without the
+ * mutex (see alarm_index.h), so an alarm published in the index is
+ * never changed in place, apart from the deadline of a periodic
+ * one, which is stored atomically. A replacement is queued as a new
+ * alarm, and an alarm taken out of the index is retired (see
+ * alarm_epoch.h) with a reference of its own, so that it outlives
+ * any reader still looking at it.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include "alarm_shard.h"
+#include "alarm_time.h"
+#include "alarm_pool.h"
+#include "alarm_epoch.h"
+#include "alarm_dispatch.h"
+#include "alarm_engine.h"
+#include "alarm_clock.h"
+#include "alarm_server.h"
+#include "alarm_stats.h"
+#include "alarm_journal.h"
+#include "errors.h"
+
+/*
+ * The longest a command may wait in the submit queue before the
+ * alarm thread is woken to apply it. This bounds how late a
+ * "Replacing" or "Cancel" acknowledgement can be.
+ */
+#define SUBMIT_LATENCY  NSEC_PER_MSEC
+
+/*
+ * How long an alarm thread with retired alarms still waiting for
+ * readers to finish may sleep before it tries again to free them.
+ */
+#define RECLAIM_LATENCY (10 * NSEC_PER_MSEC)
+
+shard_t *shards;
+int shard_count;
+
+void shard_lock (shard_t *shard)
+{
+    int status;
+
+    status = pthread_mutex_lock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+}
+
+void shard_unlock (shard_t *shard)
+{
+    int status;
+
+    status = pthread_mutex_unlock (&shard->mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+}
+
+shard_t *shard_for (int number)
+{
+    uint64_t hash;
+
+    hash = (uint64_t)(uint32_t)number * 0x9E3779B97F4A7C15ULL;
+    return &shards[(hash >> 32) % shard_count];
+}
+
+/*
+ * Queue commands for the shard's alarm thread, and wake the
+ * thread if it would not otherwise get to them by the earliest
+ * new deadline among them or within SUBMIT_LATENCY. The wake
+ * moves current_alarm earlier with a compare-and-swap, so of
+ * several submitters racing only those that actually make it
+ * earlier signal.
+ *
+ * The wake time is worked out before the push, since the alarm
+ * thread may apply (and free) the commands as soon as they are
+ * pushed.
+ */
+void shard_submit (shard_t *shard, alarm_t *first, alarm_t *last)
+{
+    alarm_t *command;
+    int64_t wake, current;
+
+    wake = alarm_now () + SUBMIT_LATENCY;
+    for (command = first; ; command = command->link) {
+        if (command->op == ALARM_SET && command->time < wake)
+            wake = command->time;
+        if (command == last)
+            break;
+    }
+    mpsc_push (&shard->submit, first, last);
+    current = __atomic_load_n (&shard->current_alarm, __ATOMIC_SEQ_CST);
+    while (wake < current) {
+        if (__atomic_compare_exchange_n (&shard->current_alarm, &current,
+                wake, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            stats_count (STAT_SUBMIT_WAKES, 1);
+            clock_wake (&shard->waiter);
+            break;
+        }
+    }
+}
+
+/*
+ * The routines below are only called by the shard's alarm
+ * thread, with the shard's mutex locked.
+ *
+ * Insert alarm entry in the pending queue.
+ */
+static void alarm_insert (shard_t *shard, alarm_t *alarm)
+{
+    queue_insert (shard->queue, alarm);
+    index_insert (shard->index, alarm);
+#ifdef DEBUG
+    queue_dump (shard->queue);
+#endif
+}
+
+static void alarm_unref (void *alarm)
+{
+    alarm_release ((alarm_t*)alarm);
+}
+
+/*
+ * Take an alarm out of the index, and keep a reference to it until
+ * no reader can still be looking at it.
+ */
+static void alarm_unindex (shard_t *shard, alarm_t *alarm)
+{
+    index_remove (shard->index, alarm);
+    __atomic_add_fetch (&alarm->refs, 1, __ATOMIC_RELAXED);
+    epoch_retire (alarm_unref, alarm);
+}
+
+/*
+ * Remove a pending alarm from the queue and the index, and release
+ * it; a periodic alarm whose last firing is still on its way to a
+ * dispatcher is freed once that has been delivered.
+ */
+static void alarm_cancel (shard_t *shard, alarm_t *alarm)
+{
+    queue_remove (shard->queue, alarm);
+    alarm_unindex (shard, alarm);
+    alarm_release (alarm);
+}
+
+/*
+ * Apply every command waiting in the submit queue.
+ */
+static void shard_apply (shard_t *shard)
+{
+    alarm_t *command, *pending;
+
+    while ((command = mpsc_pop (&shard->submit)) != NULL) {
+        pending = index_find (shard->index, command->Message_Number);
+        if (command->op == ALARM_CANCEL) {
+            if (pending != NULL) {
+                client_printf (command->body->client, STDOUT_FILENO, "Alarm Cancel Received at <%ld>:<Message(%d) %s>\n",
+                    (long)alarm_time (), pending->Message_Number, pending->body->message);
+                alarm_cancel (shard, pending);
+                stats_count (STAT_CANCELLED, 1);
+            } else {
+                client_printf (command->body->client, STDERR_FILENO, "No alarm with Message(%d)\n",
+                    command->Message_Number);
+                stats_count (STAT_CANCEL_MISSED, 1);
+            }
+            alarm_free (command);
+        } else if (pending != NULL) {
+            /*
+             * An alarm with the same Message_Number is swapped
+             * for the command, which readers or a dispatcher may
+             * still be looking at.
+             */
+            client_printf (command->body->client, STDOUT_FILENO, "Alarm with Message Number(%d) EXISTS! Replacing that alarm.\n",
+                command->Message_Number);
+            alarm_cancel (shard, pending);
+            alarm_insert (shard, command);
+            stats_count (STAT_REPLACED, 1);
+        } else {
+            alarm_insert (shard, command);
+            stats_count (STAT_INSERTED, 1);
+        }
+    }
+}
+
+void shard_walk (shard_t *shard, void (*visit) (alarm_t *alarm, void *arg),
+    void *arg)
+{
+    shard_apply (shard);
+    index_walk (shard->index, visit, arg);
+}
+
+void shard_sync (shard_t *shard)
+{
+    shard_lock (shard);
+    shard_apply (shard);
+    shard_unlock (shard);
+}
+
+void shard_scan (shard_t *shard, void (*visit) (alarm_t *alarm, void *arg),
+    void *arg)
+{
+    shard_sync (shard);
+    epoch_enter ();
+    index_walk (shard->index, visit, arg);
+    epoch_exit ();
+    epoch_collect ();
+}
+
+/*
+ * The alarm thread's start routine. There is one per shard.
+ */
+static void *alarm_thread (void *arg)
+{
+    shard_t *shard = (shard_t*)arg;
+    alarm_t *due, *alarm, *next, *batch, **tail;
+    int64_t now, wake, deadline, missed;
+    int count, expired, last, status;
+
+    /*
+     * Loop forever, processing commands. The alarm thread will
+     * be disintegrated when the process exits. Lock the mutex
+     * at the start -- it will be unlocked during engine waits,
+     * so that submitters can signal.
+     */
+    shard_lock (shard);
+    while (1) {
+        shard_apply (shard);
+        now = alarm_now ();
+        due = NULL;
+        if (!queue_empty (shard->queue) && queue_next (shard->queue) <= now)
+            due = queue_expire (shard->queue, now);
+        if (due != NULL) {
+            /*
+             * Everything due has been detached from the queue in
+             * one step. Drop the one-shot alarms from the index and
+             * re-arm the periodic ones (and journal the firings)
+             * while the mutex is still held, then hand the whole
+             * batch to the dispatchers without holding it:
+             * dispatch_put blocks if they have fallen too far
+             * behind, and main must still be able to schedule
+             * alarms meanwhile.
+             */
+            batch = NULL;
+            tail = &batch;
+            count = expired = 0;
+            for (alarm = due; alarm != NULL; alarm = next) {
+                next = alarm->link;
+
+                /*
+                 * A periodic alarm whose next deadline would not
+                 * fit below INT64_MAX fires for the last time.
+                 */
+                last = 1;
+                if (alarm->period != 0) {
+                    deadline = alarm->body->deadline;
+                    missed = (now - deadline) / alarm->period;
+                    deadline += missed * alarm->period;
+                    last = alarm->period >= INT64_MAX - deadline;
+                }
+                if (alarm->period != 0
+                        && __atomic_load_n (&alarm->refs, __ATOMIC_ACQUIRE) > 1) {
+                    stats_count (STAT_SKIPPED, 1);
+                    if (last) {
+                        alarm_unindex (shard, alarm);
+                        alarm_release (alarm);
+                        expired++;
+                    }
+                } else {
+                    if (last) {
+                        alarm_unindex (shard, alarm);
+                        expired++;
+                    } else
+                        __atomic_store_n (&alarm->refs, 2, __ATOMIC_RELAXED);
+                    alarm->body->fired = alarm->body->deadline;
+                    *tail = alarm;
+                    tail = &alarm->batch;
+                    count++;
+                }
+                if (!last) {
+                    deadline += alarm->period;
+                    __atomic_store_n (&alarm->body->deadline, deadline,
+                        __ATOMIC_RELAXED);
+                    alarm->time = deadline_slack (deadline, alarm->body->slack);
+                    queue_insert (shard->queue, alarm);
+                    stats_count (STAT_REARMED, 1);
+                    stats_count (STAT_SKIPPED, missed);
+                }
+            }
+            *tail = NULL;
+            journal_fire (batch);
+            stats_count (STAT_EXPIRED, expired);
+            stats_record (HIST_BATCH, count);
+            shard_unlock (shard);
+            if (batch != NULL) {
+                clock_hold (count);
+                dispatch_put (shard->id, batch);
+            }
+            shard_lock (shard);
+            continue;
+        }
+        /*
+         * Nothing is due yet. Sleep until the queue next has
+         * work (for the wheel, that may just be a cascade), or
+         * forever if it is empty, unless shard_submit moves
+         * current_alarm earlier. Publish the time first and
+         * then check for commands that arrived meanwhile.
+         */
+        wake = queue_empty (shard->queue) ? INT64_MAX : queue_next (shard->queue);
+        if (epoch_collect () > 0 && wake - now > RECLAIM_LATENCY)
+            wake = now + RECLAIM_LATENCY;
+#ifdef DEBUG
+        {
+            pool_stats_t pool;
+
+            pool_stats (&pool);
+            printf ("[shard %d waiting: %lld(%lld)] [pool: %ld/%ld in use, %ld cached, %ld slabs]\n",
+                shard->id, (long long)wake, (long long)(wake - now),
+                pool.in_use, pool.capacity, pool.cached, pool.slabs);
+        }
+#endif
+        __atomic_store_n (&shard->current_alarm, wake, __ATOMIC_SEQ_CST);
+        if (mpsc_pending (&shard->submit))
+            continue;
+        do {
+            wake = __atomic_load_n (&shard->current_alarm, __ATOMIC_SEQ_CST);
+            status = clock_wait (&shard->waiter, wake);
+            stats_count (STAT_WAKEUPS, 1);
+        } while (status != ETIMEDOUT);
+    }
+}
+
+/*
+ * Create "count" shards and start their alarm threads.
+ */
+void shard_start (int count)
+{
+    pthread_t thread;
+    shard_t *shard;
+    void *block;
+    int i, status;
+
+    status = posix_memalign (&block, 64, count * sizeof (shard_t));
+    if (status != 0)
+        err_abort (status, "Allocate shards");
+    shards = (shard_t*)block;
+    shard_count = count;
+    for (i = 0; i < count; i++) {
+        shard = &shards[i];
+        status = pthread_mutex_init (&shard->mutex, NULL);
+        if (status != 0)
+            err_abort (status, "Init mutex");
+        shard->engine = engine_create ();
+        clock_join (&shard->waiter, shard->engine, &shard->mutex);
+        shard->queue = queue_create ();
+        shard->index = index_create ();
+        shard->current_alarm = INT64_MAX;
+        mpsc_init (&shard->submit);
+        shard->id = i;
+    }
+    for (i = 0; i < count; i++) {
+        status = pthread_create (
+            &thread, NULL, alarm_thread, &shards[i]);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+        pthread_detach (thread);
+    }
+}
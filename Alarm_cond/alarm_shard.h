@@ -0,0 +1,96 @@
+#ifndef __alarm_shard_h
+#define __alarm_shard_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "alarm.h"
+#include "alarm_queue.h"
+#include "alarm_index.h"
+#include "alarm_mpsc.h"
+#include "alarm_engine.h"
+#include "alarm_clock.h"
+
+/*
+ * The alarm engine is split into shards. Each shard has its own
+ * pending queue, Message_Number index, mutex, timing engine and
+ * alarm thread, so scheduling on different shards never
+ * contends. An alarm always lives on the shard picked by hashing
+ * its Message_Number (shard_for), which keeps a Cancel or a
+ * replacement on the same shard as the alarm it refers to.
+ *
+ * Each shard also owns a dispatch ring (see alarm_dispatch.h)
+ * into which its alarm thread puts expired alarms.
+ *
+ * Only the alarm thread touches a shard's queue and index. Other
+ * threads hand it commands through the shard's lock-free "submit"
+ * queue (see shard_submit), so any number of them can schedule and
+ * cancel alarms without contending with it or with each other.
+ * "current_alarm" is the time at which the alarm thread will next
+ * look at its queues (INT64_MAX when it has nothing pending); it
+ * is read and lowered atomically.
+ *
+ * Reader threads (see alarm_query.h) and exports (see shard_scan)
+ * look up and walk the pending alarms in the index with no lock at
+ * all, while the alarm thread goes on changing them; the alarms
+ * they may still be looking at are reclaimed by epochs (see
+ * alarm_epoch.h). However long a walk takes, the alarm thread
+ * never waits for it.
+ *
+ * Shards are cache-line aligned so that two shards' hot fields
+ * never share a line.
+ */
+typedef struct shard_tag {
+    pthread_mutex_t     mutex;
+    engine_t            *engine;
+    clock_waiter_t      waiter;
+    queue_t             *queue;
+    index_t             *index;
+    int64_t             current_alarm;
+    mpsc_t              submit;
+    int                 id;
+} __attribute__ ((aligned (64))) shard_t;
+
+extern shard_t *shards;
+extern int shard_count;
+
+void shard_start (int count);
+shard_t *shard_for (int number);
+void shard_lock (shard_t *shard);
+void shard_unlock (shard_t *shard);
+
+/*
+ * Pass commands (alarms from alarm_alloc, with "op" set) to the
+ * alarm thread of the shard their Message_Numbers belong to. They
+ * are chained first..last through "link" (first == last for a
+ * single command), and are applied in that order. The shard takes
+ * the alarms over. The caller needs no lock.
+ */
+void shard_submit (shard_t *shard, alarm_t *first, alarm_t *last);
+
+/*
+ * Call "visit" on every alarm pending on the shard, after applying
+ * any commands still waiting in its submit queue. The caller must
+ * have locked the shard.
+ */
+void shard_walk (shard_t *shard, void (*visit) (alarm_t *alarm, void *arg),
+    void *arg);
+
+/*
+ * Apply any commands still waiting in the shard's submit queue, so
+ * that a look at its index that follows sees them. The caller must
+ * not have locked the shard.
+ */
+void shard_sync (shard_t *shard);
+
+/*
+ * Like shard_walk, but the caller must not have locked the shard:
+ * it is only locked while the waiting commands are applied, and
+ * the alarms are then walked without the lock, while the alarm
+ * thread goes on firing them (see index_walk for what the walk
+ * sees). "visit" must read a pending alarm's deadline atomically.
+ */
+void shard_scan (shard_t *shard, void (*visit) (alarm_t *alarm, void *arg),
+    void *arg);
+
+#endif
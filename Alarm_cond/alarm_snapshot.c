@@ -0,0 +1,239 @@
+/*
+ * alarm_snapshot.c
+ *
+ * Saving and loading the pending alarms (see alarm_snapshot.h).
+ *
+ * Saving collects the records and the text table in memory while
+ * the shards are walked and then writes them out with three
+ * writes. Loading maps the whole file and makes a single pass over
+ * the records, chaining the new alarms by shard so that each
+ * shard's alarm thread takes in its share with one submit queue
+ * push and one wakeup.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "alarm_snapshot.h"
+#include "alarm_shard.h"
+#include "alarm_pool.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+typedef struct saving_tag {
+    snapshot_record_t   *record;
+    uint64_t            count;
+    uint64_t            size;           /* records allocated */
+    char                *strings;
+    uint64_t            length;
+    uint64_t            room;           /* bytes allocated */
+    int64_t             offset;         /* wall clock - monotonic */
+} saving_t;
+
+static void *grow (void *block, uint64_t *size, uint64_t need, size_t unit)
+{
+    uint64_t new_size = *size;
+
+    if (need <= *size)
+        return block;
+    while (new_size < need)
+        new_size = new_size < 1024 ? 1024 : new_size * 2;
+    block = realloc (block, new_size * unit);
+    if (block == NULL)
+        errno_abort ("Allocate snapshot");
+    *size = new_size;
+    return block;
+}
+
+static void snapshot_visit (alarm_t *alarm, void *arg)
+{
+    saving_t *saving = (saving_t*)arg;
+    snapshot_record_t *record;
+    size_t length = alarm->body->length;
+
+    saving->record = (snapshot_record_t*)grow (saving->record, &saving->size,
+        saving->count + 1, sizeof (snapshot_record_t));
+    saving->strings = (char*)grow (saving->strings, &saving->room,
+        saving->length + length, 1);
+    record = &saving->record[saving->count++];
+    record->deadline = alarm->body->deadline + saving->offset;
+    record->slack = alarm->body->slack;
+    record->interval = alarm->body->interval;
+    record->period = alarm->period;
+    record->number = alarm->Message_Number;
+    record->length = length;
+    record->text = saving->length;
+    memcpy (saving->strings + saving->length, alarm->body->message, length);
+    saving->length += length;
+}
+
+/*
+ * Write all of "size" bytes, however many calls it takes.
+ */
+static int write_all (int fd, const void *data, size_t size)
+{
+    const char *p = (const char*)data;
+    ssize_t done;
+
+    while (size > 0) {
+        done = write (fd, p, size);
+        if (done == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += done;
+        size -= done;
+    }
+    return 0;
+}
+
+long snapshot_save (const char *path)
+{
+    saving_t saving;
+    snapshot_header_t header;
+    char temp[4096];
+    int i, fd, error;
+
+    memset (&saving, 0, sizeof (saving));
+    saving.offset = alarm_wall () - alarm_now ();
+    for (i = 0; i < shard_count; i++)
+        shard_walk (&shards[i], snapshot_visit, &saving);
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.record_size = sizeof (snapshot_record_t);
+    header.count = saving.count;
+    header.strings = saving.length;
+    header.saved = alarm_wall ();
+
+    snprintf (temp, sizeof (temp), "%s.tmp", path);
+    fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1
+            || write_all (fd, &header, sizeof (header)) == -1
+            || write_all (fd, saving.record,
+                saving.count * sizeof (snapshot_record_t)) == -1
+            || write_all (fd, saving.strings, saving.length) == -1
+            || fsync (fd) == -1
+            || close (fd) == -1
+            || rename (temp, path) == -1) {
+        error = errno;
+        if (fd != -1) {
+            close (fd);
+            unlink (temp);
+        }
+        free (saving.record);
+        free (saving.strings);
+        errno = error;
+        return -1;
+    }
+    free (saving.record);
+    free (saving.strings);
+    return (long)saving.count;
+}
+
+long snapshot_load (const char *path, long *overdue)
+{
+    snapshot_header_t *header;
+    snapshot_record_t *record;
+    alarm_t **first, **last, *alarm;
+    const char *strings;
+    struct stat info;
+    void *map;
+    uint64_t i, length;
+    int64_t offset, now;
+    long loaded = 0;
+    int fd, shard;
+
+    *overdue = 0;
+    fd = open (path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat (fd, &info) == -1) {
+        close (fd);
+        return -1;
+    }
+    if (info.st_size < (off_t)sizeof (snapshot_header_t)) {
+        close (fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise (map, info.st_size, MADV_SEQUENTIAL);
+
+    /*
+     * Check that the header is ours and that the records and the
+     * text table exactly fill the file.
+     */
+    header = (snapshot_header_t*)map;
+    if (memcmp (header->magic, SNAPSHOT_MAGIC, sizeof (header->magic)) != 0
+            || header->version != SNAPSHOT_VERSION
+            || header->record_size != sizeof (snapshot_record_t)
+            || header->count > (info.st_size - sizeof (snapshot_header_t))
+                / sizeof (snapshot_record_t)
+            || sizeof (snapshot_header_t)
+                + header->count * sizeof (snapshot_record_t)
+                + header->strings != (size_t)info.st_size) {
+        munmap (map, info.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    record = (snapshot_record_t*)(header + 1);
+    strings = (const char*)(record + header->count);
+
+    /*
+     * A negative period or slack would break the alarm thread's
+     * arithmetic; refuse the whole file before loading any of it.
+     */
+    for (i = 0; i < header->count; i++)
+        if (record[i].period < 0 || record[i].slack < 0) {
+            munmap (map, info.st_size);
+            errno = EINVAL;
+            return -1;
+        }
+
+    first = (alarm_t**)calloc (shard_count, sizeof (alarm_t*));
+    last = (alarm_t**)calloc (shard_count, sizeof (alarm_t*));
+    if (first == NULL || last == NULL)
+        errno_abort ("Allocate snapshot load");
+    now = alarm_now ();
+    offset = now - alarm_wall ();
+    for (i = 0; i < header->count; i++, record++) {
+        if (record->text > header->strings
+                || record->length > header->strings - record->text)
+            continue;
+        length = record->length;
+        alarm = alarm_alloc (length);
+        alarm->op = ALARM_SET;
+        alarm->Message_Number = record->number;
+        alarm->period = record->period;
+        alarm->body->client = 0;
+        alarm->body->interval = record->interval;
+        alarm->body->deadline = record->deadline + offset;
+        alarm->body->slack = record->slack;
+        alarm->time = deadline_slack (alarm->body->deadline, alarm->body->slack);
+        memcpy (alarm->body->message, strings + record->text, length);
+        alarm->body->message[length] = '\0';
+        alarm->link = NULL;
+        if (alarm->body->deadline <= now)
+            (*overdue)++;
+        loaded++;
+        shard = shard_for (alarm->Message_Number) - shards;
+        if (first[shard] == NULL)
+            first[shard] = alarm;
+        else
+            last[shard]->link = alarm;
+        last[shard] = alarm;
+    }
+    for (shard = 0; shard < shard_count; shard++)
+        if (first[shard] != NULL)
+            shard_submit (&shards[shard], first[shard], last[shard]);
+    free (first);
+    free (last);
+    munmap (map, info.st_size);
+    return loaded;
+}
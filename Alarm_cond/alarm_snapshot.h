@@ -0,0 +1,61 @@
+#ifndef __alarm_snapshot_h
+#define __alarm_snapshot_h
+
+#include <stdint.h>
+
+/*
+ * A snapshot is a file holding every pending alarm, so that a
+ * restarted program picks up where the last one stopped. It is a
+ * header, an array of fixed-size records and a table of the
+ * message texts:
+ *
+ *      snapshot_header_t
+ *      snapshot_record_t[count]
+ *      char[strings]           texts, not NUL-terminated
+ *
+ * Integers are in the machine's byte order; "magic" and "version"
+ * reject a file from elsewhere. Deadlines are CLOCK_REALTIME
+ * nanoseconds, since a monotonic reading means nothing after a
+ * restart; an alarm whose deadline passed while the program was
+ * down fires as soon as it is loaded.
+ */
+#define SNAPSHOT_MAGIC          "ALRMSNAP"
+#define SNAPSHOT_VERSION        3
+
+typedef struct snapshot_header_tag {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            record_size;    /* sizeof (snapshot_record_t) */
+    uint64_t            count;          /* records */
+    uint64_t            strings;        /* bytes of text */
+    int64_t             saved;          /* wall clock, nsec */
+} snapshot_header_t;
+
+typedef struct snapshot_record_tag {
+    int64_t             deadline;       /* wall clock, nsec */
+    int64_t             interval;       /* as requested, nsec */
+    int64_t             period;         /* 0, or nsec between firings */
+    int64_t             slack;          /* nsec */
+    int32_t             number;         /* Message_Number */
+    uint32_t            length;         /* of the text */
+    uint64_t            text;           /* offset in the text table */
+} snapshot_record_t;
+
+/*
+ * Write every pending alarm to "path" (through a temporary file
+ * renamed into place, so a crash leaves the old snapshot intact).
+ * The caller must have locked every shard. Returns the number of
+ * alarms saved, or -1 (with errno set) on failure.
+ */
+long snapshot_save (const char *path);
+
+/*
+ * Map the snapshot at "path" and submit all its alarms to their
+ * shards, one push per shard. A missing file loads nothing.
+ * Returns the number of alarms loaded, of which "overdue" were
+ * already due, or -1 (with errno set) if the file could not be
+ * read or is not a snapshot.
+ */
+long snapshot_load (const char *path, long *overdue);
+
+#endif
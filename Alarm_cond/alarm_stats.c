@@ -0,0 +1,371 @@
+/*
+ * alarm_stats.c
+ *
+ * Each thread's counts live in a stats_t of its own, allocated
+ * the first time the thread counts anything and linked onto
+ * stats_blocks. Blocks are never freed, so the counts of threads
+ * that exit are kept. Only the owning thread writes a block; it
+ * uses relaxed atomic stores so that stats_read, summing the
+ * blocks under stats_mutex, sees whole values.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "alarm_stats.h"
+#include "alarm_output.h"
+#include "alarm_server.h"
+#include "alarm_pool.h"
+#include "alarm_arena.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+typedef struct block_tag {
+    struct block_tag    *next;
+    stats_t             stats;
+} block_t;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static block_t *stats_blocks = NULL;
+static __thread block_t *stats_mine;
+static int64_t stats_started;
+
+static stats_t *stats_block (void)
+{
+    block_t *block;
+    int status;
+
+    if (stats_mine != NULL)
+        return &stats_mine->stats;
+    block = (block_t*)calloc (1, sizeof (block_t));
+    if (block == NULL)
+        errno_abort ("Allocate stats");
+    status = pthread_mutex_lock (&stats_mutex);
+    if (status != 0)
+        err_abort (status, "Lock stats");
+    block->next = stats_blocks;
+    stats_blocks = block;
+    status = pthread_mutex_unlock (&stats_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock stats");
+    stats_mine = block;
+    return &block->stats;
+}
+
+#define BUMP(field, n)  __atomic_store_n (&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void stats_count (int counter, long n)
+{
+    stats_t *stats = stats_block ();
+
+    BUMP (stats->counter[counter], n);
+}
+
+/*
+ * Values below HIST_SUB have a bucket each; above that, a value
+ * whose top bit is bit "e" goes in one of the HIST_SUB buckets of
+ * row e - HIST_SUB_BITS + 1, picked by its next HIST_SUB_BITS
+ * bits.
+ */
+static int hist_bucket (int64_t value)
+{
+    int shift, index;
+
+    if (value < HIST_SUB)
+        return value < 0 ? 0 : (int)value;
+    shift = 63 - __builtin_clzll ((uint64_t)value) - HIST_SUB_BITS;
+    index = (shift + 1) * HIST_SUB + (int)(value >> shift) - HIST_SUB;
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/*
+ * The smallest value that goes in bucket "index".
+ */
+static int64_t hist_value (int index)
+{
+    int shift;
+
+    if (index < HIST_SUB)
+        return index;
+    shift = index / HIST_SUB - 1;
+    return (int64_t)(index % HIST_SUB + HIST_SUB) << shift;
+}
+
+void stats_record (int histogram, int64_t value)
+{
+    histogram_t *hist = &stats_block ()->hist[histogram];
+    int index = hist_bucket (value);
+
+    BUMP (hist->bucket[index], 1);
+    BUMP (hist->count, 1);
+    BUMP (hist->sum, value);
+    if (value > hist->max)
+        __atomic_store_n (&hist->max, value, __ATOMIC_RELAXED);
+}
+
+#define LOAD(field)     __atomic_load_n (&(field), __ATOMIC_RELAXED)
+
+void stats_read (stats_t *stats)
+{
+    block_t *block;
+    histogram_t *from, *to;
+    int i, h, status;
+
+    memset (stats, 0, sizeof (stats_t));
+    status = pthread_mutex_lock (&stats_mutex);
+    if (status != 0)
+        err_abort (status, "Lock stats");
+    for (block = stats_blocks; block != NULL; block = block->next) {
+        for (i = 0; i < STAT_COUNTERS; i++)
+            stats->counter[i] += LOAD (block->stats.counter[i]);
+        for (h = 0; h < HIST_COUNT; h++) {
+            from = &block->stats.hist[h];
+            to = &stats->hist[h];
+            to->count += LOAD (from->count);
+            to->sum += LOAD (from->sum);
+            if (LOAD (from->max) > to->max)
+                to->max = LOAD (from->max);
+            for (i = 0; i < HIST_BUCKETS; i++)
+                to->bucket[i] += LOAD (from->bucket[i]);
+        }
+    }
+    status = pthread_mutex_unlock (&stats_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock stats");
+}
+
+/*
+ * The answer is the top of the bucket the percentile falls in
+ * (but never more than the largest value recorded), so it errs
+ * on the high side by at most one bucket.
+ */
+int64_t stats_percentile (histogram_t *hist, double fraction)
+{
+    long seen = 0, want;
+    int64_t top;
+    int i;
+
+    if (hist->count == 0)
+        return 0;
+    want = (long)(hist->count * fraction);
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += hist->bucket[i];
+        if (seen >= want)
+            break;
+    }
+    top = i < HIST_BUCKETS - 1 ? hist_value (i + 1) - 1 : hist->max;
+    return top < hist->max ? top : hist->max;
+}
+
+void stats_report (int client, int fd)
+{
+    static stats_t last;
+    static int64_t last_time;
+    stats_t stats;
+    histogram_t *late, *batch;
+    pool_stats_t pool;
+    arena_stats_t arena;
+    int64_t now;
+    double span;
+    long *c;
+
+    stats_read (&stats);
+    now = alarm_now ();
+    if (last_time == 0)
+        last_time = stats_started;
+    span = (double)(now - last_time) / NSEC_PER_SEC;
+    if (span <= 0)
+        span = 1e-9;
+    c = stats.counter;
+    late = &stats.hist[HIST_LATENESS];
+    batch = &stats.hist[HIST_BATCH];
+    client_printf (client, fd, "Stats after %.1fs: %ld pending\n",
+        (double)(now - stats_started) / NSEC_PER_SEC,
+        c[STAT_INSERTED] - c[STAT_CANCELLED] - c[STAT_EXPIRED]);
+    client_printf (client, fd, "  commands: %ld set (%.0f/s), %ld cancel (%.0f/s), %ld query, %ld bad\n",
+        c[STAT_SET], (c[STAT_SET] - last.counter[STAT_SET]) / span,
+        c[STAT_CANCEL], (c[STAT_CANCEL] - last.counter[STAT_CANCEL]) / span,
+        c[STAT_QUERY], c[STAT_BAD]);
+    client_printf (client, fd, "  alarms: %ld inserted, %ld replaced, %ld cancelled (%ld not found), %ld expired\n",
+        c[STAT_INSERTED], c[STAT_REPLACED], c[STAT_CANCELLED],
+        c[STAT_CANCEL_MISSED], c[STAT_EXPIRED]);
+    client_printf (client, fd, "  delivered: %ld (%.0f/s), %ld stolen\n",
+        c[STAT_DELIVERED], (c[STAT_DELIVERED] - last.counter[STAT_DELIVERED]) / span,
+        c[STAT_STOLEN]);
+    client_printf (client, fd, "  wakeups: %ld (%.0f/s), %ld of them by commands\n",
+        c[STAT_WAKEUPS], (c[STAT_WAKEUPS] - last.counter[STAT_WAKEUPS]) / span,
+        c[STAT_SUBMIT_WAKES]);
+    if (c[STAT_REARMED] > 0)
+        client_printf (client, fd, "  periodic: %ld re-armed (%.0f/s), %ld firings skipped\n",
+            c[STAT_REARMED], (c[STAT_REARMED] - last.counter[STAT_REARMED]) / span,
+            c[STAT_SKIPPED]);
+    if (c[STAT_JOURNAL_SYNCS] > 0)
+        client_printf (client, fd, "  journal: %ld syncs (%.0f/s), %ld bytes\n",
+            c[STAT_JOURNAL_SYNCS],
+            (c[STAT_JOURNAL_SYNCS] - last.counter[STAT_JOURNAL_SYNCS]) / span,
+            c[STAT_JOURNAL_BYTES]);
+    if (late->count > 0)
+        client_printf (client, fd, "  lateness: mean %lldus, p50 %lldus, p99 %lldus, p99.9 %lldus, max %lldus\n",
+            (long long)(late->sum / late->count / NSEC_PER_USEC),
+            (long long)(stats_percentile (late, 0.5) / NSEC_PER_USEC),
+            (long long)(stats_percentile (late, 0.99) / NSEC_PER_USEC),
+            (long long)(stats_percentile (late, 0.999) / NSEC_PER_USEC),
+            (long long)(late->max / NSEC_PER_USEC));
+    if (batch->count > 0)
+        client_printf (client, fd, "  expiry batches: %ld, mean %.1f, p50 %lld, p99 %lld, max %lld alarms\n",
+            batch->count, (double)batch->sum / batch->count,
+            (long long)stats_percentile (batch, 0.5),
+            (long long)stats_percentile (batch, 0.99),
+            (long long)batch->max);
+    pool_stats (&pool);
+    arena_stats (&arena);
+    client_printf (client, fd, "  memory: %ld alarms in %.1fMB of slabs, %.1fMB of bodies in %.1fMB of arena\n",
+        pool.in_use, (double)pool.bytes / (1024 * 1024),
+        (double)arena.in_use / (1024 * 1024),
+        (double)(arena.chunks + arena.large) / (1024 * 1024));
+    last = stats;
+    last_time = now;
+}
+
+/*
+ * Write a Prometheus histogram, with cumulative buckets at the
+ * "le" bounds (in the histogram's units, scaled by "scale" for
+ * printing). A bucket of ours is counted under a bound once all of
+ * it lies below the bound, so the counts err on the low side.
+ */
+static void prom_histogram (FILE *file, const char *name, const char *help,
+    histogram_t *hist, const int64_t *le, int count, double scale)
+{
+    long seen = 0;
+    int i, b = 0;
+
+    fprintf (file, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < count; i++) {
+        while (b < HIST_BUCKETS - 1 && hist_value (b + 1) - 1 <= le[i])
+            seen += hist->bucket[b++];
+        fprintf (file, "%s_bucket{le=\"%g\"} %ld\n", name, le[i] / scale, seen);
+    }
+    fprintf (file, "%s_bucket{le=\"+Inf\"} %ld\n", name, hist->count);
+    fprintf (file, "%s_sum %g\n%s_count %ld\n", name, hist->sum / scale,
+        name, hist->count);
+}
+
+static void prom_counter (FILE *file, const char *name, const char *help,
+    long value)
+{
+    fprintf (file, "# HELP %s %s\n# TYPE %s counter\n%s %ld\n",
+        name, help, name, name, value);
+}
+
+/*
+ * Write the file under a temporary name and rename it into
+ * place, so that a scraper never sees half of it.
+ */
+static void stats_dump (const char *path)
+{
+    static const int64_t late_le[] = {
+        10 * NSEC_PER_USEC, 50 * NSEC_PER_USEC, 100 * NSEC_PER_USEC,
+        250 * NSEC_PER_USEC, 500 * NSEC_PER_USEC, NSEC_PER_MSEC,
+        2 * NSEC_PER_MSEC, 5 * NSEC_PER_MSEC, 10 * NSEC_PER_MSEC,
+        50 * NSEC_PER_MSEC, 100 * NSEC_PER_MSEC, NSEC_PER_SEC};
+    static const int64_t batch_le[] = {1, 2, 4, 8, 16, 64, 256, 1024, 4096};
+    stats_t stats;
+    pool_stats_t pool;
+    arena_stats_t arena;
+    char temp[4096];
+    FILE *file;
+    long *c;
+
+    stats_read (&stats);
+    pool_stats (&pool);
+    arena_stats (&arena);
+    c = stats.counter;
+    snprintf (temp, sizeof (temp), "%s.tmp", path);
+    file = fopen (temp, "w");
+    if (file == NULL) {
+        output_printf (STDERR_FILENO, "Cannot write %s: %s\n", temp, strerror (errno));
+        return;
+    }
+    fprintf (file, "# HELP alarm_commands_total Commands read, by kind.\n"
+        "# TYPE alarm_commands_total counter\n"
+        "alarm_commands_total{kind=\"set\"} %ld\n"
+        "alarm_commands_total{kind=\"cancel\"} %ld\n"
+        "alarm_commands_total{kind=\"query\"} %ld\n"
+        "alarm_commands_total{kind=\"bad\"} %ld\n",
+        c[STAT_SET], c[STAT_CANCEL], c[STAT_QUERY], c[STAT_BAD]);
+    prom_counter (file, "alarm_inserted_total", "New alarms queued.", c[STAT_INSERTED]);
+    prom_counter (file, "alarm_replaced_total", "Pending alarms replaced.", c[STAT_REPLACED]);
+    prom_counter (file, "alarm_cancelled_total", "Pending alarms cancelled.", c[STAT_CANCELLED]);
+    prom_counter (file, "alarm_cancel_missed_total", "Cancels that found no pending alarm.",
+        c[STAT_CANCEL_MISSED]);
+    prom_counter (file, "alarm_expired_total", "Alarms that fell due.", c[STAT_EXPIRED]);
+    prom_counter (file, "alarm_delivered_total", "Alarms delivered.", c[STAT_DELIVERED]);
+    prom_counter (file, "alarm_stolen_total", "Alarms delivered by another shard's dispatcher.",
+        c[STAT_STOLEN]);
+    prom_counter (file, "alarm_submit_wakeups_total", "Alarm thread wakeups by new commands.",
+        c[STAT_SUBMIT_WAKES]);
+    prom_counter (file, "alarm_wakeups_total", "Alarm thread wakeups.",
+        c[STAT_WAKEUPS]);
+    prom_counter (file, "alarm_rearmed_total", "Periodic alarms re-armed.",
+        c[STAT_REARMED]);
+    prom_counter (file, "alarm_skipped_total", "Periodic firings missed or coalesced.",
+        c[STAT_SKIPPED]);
+    prom_counter (file, "alarm_journal_syncs_total", "Journal groups written and synced.",
+        c[STAT_JOURNAL_SYNCS]);
+    prom_counter (file, "alarm_journal_bytes_total", "Bytes written to the journal.",
+        c[STAT_JOURNAL_BYTES]);
+    fprintf (file, "# HELP alarm_pending Alarms waiting to fall due.\n"
+        "# TYPE alarm_pending gauge\nalarm_pending %ld\n",
+        c[STAT_INSERTED] - c[STAT_CANCELLED] - c[STAT_EXPIRED]);
+    fprintf (file, "# HELP alarm_memory_bytes Memory taken for alarms, by store.\n"
+        "# TYPE alarm_memory_bytes gauge\n"
+        "alarm_memory_bytes{store=\"slabs\"} %ld\n"
+        "alarm_memory_bytes{store=\"arena\"} %ld\n"
+        "alarm_memory_bytes{store=\"bodies\"} %ld\n",
+        pool.bytes, arena.chunks + arena.large, arena.in_use);
+    prom_histogram (file, "alarm_lateness_seconds", "Time from deadline to delivery.",
+        &stats.hist[HIST_LATENESS], late_le, sizeof (late_le) / sizeof (late_le[0]),
+        (double)NSEC_PER_SEC);
+    prom_histogram (file, "alarm_expiry_batch_size", "Alarms taken per expiry.",
+        &stats.hist[HIST_BATCH], batch_le, sizeof (batch_le) / sizeof (batch_le[0]), 1.0);
+    if (fclose (file) != 0 || rename (temp, path) != 0)
+        output_printf (STDERR_FILENO, "Cannot write %s: %s\n", path, strerror (errno));
+}
+
+typedef struct dump_tag {
+    const char          *path;
+    int64_t             interval;
+} dump_t;
+
+static void *stats_thread (void *arg)
+{
+    dump_t *dump = (dump_t*)arg;
+    struct timespec pause;
+
+    pause.tv_sec = dump->interval / NSEC_PER_SEC;
+    pause.tv_nsec = dump->interval % NSEC_PER_SEC;
+    while (1) {
+        nanosleep (&pause, NULL);
+        stats_dump (dump->path);
+    }
+}
+
+void stats_start (const char *path, int64_t interval)
+{
+    pthread_t thread;
+    dump_t *dump;
+    int status;
+
+    stats_started = alarm_now ();
+    if (path == NULL)
+        return;
+    dump = (dump_t*)malloc (sizeof (dump_t));
+    if (dump == NULL)
+        errno_abort ("Allocate stats dump");
+    dump->path = path;
+    dump->interval = interval;
+    status = pthread_create (&thread, NULL, stats_thread, dump);
+    if (status != 0)
+        err_abort (status, "Create stats thread");
+    pthread_detach (thread);
+}
@@ -0,0 +1,81 @@
+#ifndef __alarm_stats_h
+#define __alarm_stats_h
+
+#include <stdint.h>
+
+/*
+ * Runtime statistics. Every thread counts into a block of its own
+ * (with relaxed atomic stores, so that readers can sum the blocks
+ * while the threads run), so counting costs no shared
+ * read-modify-write operations and no locks.
+ *
+ * Histograms are log-linear, as in HdrHistogram: each power of
+ * two is split into HIST_SUB linear buckets, so a recorded value
+ * is kept to within 1/HIST_SUB (about 6%) at any magnitude.
+ */
+#define STAT_SET                0       /* set commands */
+#define STAT_CANCEL             1       /* cancel commands */
+#define STAT_BAD                2       /* bad command lines */
+#define STAT_INSERTED           3       /* new alarms queued */
+#define STAT_REPLACED           4       /* pending alarms replaced */
+#define STAT_CANCELLED          5       /* pending alarms cancelled */
+#define STAT_CANCEL_MISSED      6       /* cancels of no pending alarm */
+#define STAT_SUBMIT_WAKES       7       /* alarm threads woken by commands */
+#define STAT_WAKEUPS            8       /* alarm thread wakeups */
+#define STAT_EXPIRED            9       /* alarms taken off the queues */
+#define STAT_DELIVERED          10      /* alarms printed */
+#define STAT_STOLEN             11      /* ... by another shard's dispatcher */
+#define STAT_JOURNAL_SYNCS      12      /* journal groups synced */
+#define STAT_JOURNAL_BYTES      13      /* ... and their size */
+#define STAT_REARMED            14      /* periodic alarms re-armed */
+#define STAT_SKIPPED            15      /* ... firings missed or coalesced */
+#define STAT_QUERY              16      /* List and Query commands */
+#define STAT_COUNTERS           17
+
+#define HIST_LATENESS           0       /* deadline to delivery, nsec */
+#define HIST_BATCH              1       /* alarms per expiry batch */
+#define HIST_COUNT              2
+
+#define HIST_SUB_BITS           4
+#define HIST_SUB                (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            ((48 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram_tag {
+    long                count;
+    int64_t             sum;
+    int64_t             max;
+    long                bucket[HIST_BUCKETS];
+} histogram_t;
+
+typedef struct stats_tag {
+    long                counter[STAT_COUNTERS];
+    histogram_t         hist[HIST_COUNT];
+} stats_t;
+
+void stats_count (int counter, long n);
+void stats_record (int histogram, int64_t value);
+
+/*
+ * Sum every thread's counts into "stats".
+ */
+void stats_read (stats_t *stats);
+
+/*
+ * The value below which "fraction" of a histogram's values lie.
+ */
+int64_t stats_percentile (histogram_t *hist, double fraction);
+
+/*
+ * Print a summary of the counts with client_printf (see
+ * alarm_server.h). Rates are per second since the previous call,
+ * which only one thread may make.
+ */
+void stats_report (int client, int fd);
+
+/*
+ * Rewrite "path" every "interval" nanoseconds with the counts in
+ * the Prometheus text exposition format.
+ */
+void stats_start (const char *path, int64_t interval);
+
+#endif
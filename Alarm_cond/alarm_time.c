@@ -0,0 +1,109 @@
+/*
+ * alarm_time.c
+ *
+ * Clock readings and the duration syntax used by the alarm
+ * commands.
+ */
+#include <ctype.h>
+#include "alarm_time.h"
+#include "errors.h"
+
+int64_t real_now (void)
+{
+    struct timespec now;
+
+    if (clock_gettime (CLOCK_MONOTONIC, &now) == -1)
+        errno_abort ("Get monotonic time");
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static int64_t real_wall (void)
+{
+    struct timespec now;
+
+    if (clock_gettime (CLOCK_REALTIME, &now) == -1)
+        errno_abort ("Get time of day");
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+int64_t (*time_now) (void) = real_now;
+int64_t (*time_wall) (void) = real_wall;
+
+int64_t alarm_now (void)
+{
+    return time_now ();
+}
+
+int64_t alarm_wall (void)
+{
+    return time_wall ();
+}
+
+time_t alarm_time (void)
+{
+    return (time_t)(time_wall () / NSEC_PER_SEC);
+}
+
+const char *duration_parse (const char *text, int64_t *nsec)
+{
+    int64_t value, unit;
+
+    while (isspace ((unsigned char)*text))
+        text++;
+    if (!isdigit ((unsigned char)*text))
+        return NULL;
+    for (value = 0; isdigit ((unsigned char)*text); text++) {
+        if (value > (INT64_MAX - 9) / 10)
+            return NULL;
+        value = value * 10 + (*text - '0');
+    }
+    if (strncmp (text, "ns", 2) == 0) {
+        unit = 1;
+        text += 2;
+    } else if (strncmp (text, "us", 2) == 0) {
+        unit = NSEC_PER_USEC;
+        text += 2;
+    } else if (strncmp (text, "ms", 2) == 0) {
+        unit = NSEC_PER_MSEC;
+        text += 2;
+    } else {
+        unit = NSEC_PER_SEC;
+        if (*text == 's')
+            text++;
+    }
+    if (*text != '\0' && *text != '~' && !isspace ((unsigned char)*text))
+        return NULL;
+    if (value > INT64_MAX / unit)
+        return NULL;
+    *nsec = value * unit;
+    return text;
+}
+
+/*
+ * The deadline and the end of the window agree on every bit above
+ * the highest one in which they differ. Keeping those bits and the
+ * end's (set) differing bit, and clearing all below, gives the
+ * multiple of the largest power of two in the window.
+ */
+int64_t deadline_slack (int64_t deadline, int64_t slack)
+{
+    uint64_t latest, differ;
+
+    if (slack <= 0 || deadline > INT64_MAX - slack)
+        return deadline;
+    latest = (uint64_t)(deadline + slack);
+    differ = (uint64_t)deadline ^ latest;
+    return (int64_t)(latest & ~(((uint64_t)1 << (63 - __builtin_clzll (differ))) - 1));
+}
+
+void duration_format (int64_t nsec, char *buffer, size_t size)
+{
+    if (nsec % NSEC_PER_SEC == 0)
+        snprintf (buffer, size, "%lld", (long long)(nsec / NSEC_PER_SEC));
+    else if (nsec % NSEC_PER_MSEC == 0)
+        snprintf (buffer, size, "%lldms", (long long)(nsec / NSEC_PER_MSEC));
+    else if (nsec % NSEC_PER_USEC == 0)
+        snprintf (buffer, size, "%lldus", (long long)(nsec / NSEC_PER_USEC));
+    else
+        snprintf (buffer, size, "%lldns", (long long)nsec);
+}
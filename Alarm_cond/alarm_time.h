@@ -0,0 +1,73 @@
+#ifndef __alarm_time_h
+#define __alarm_time_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Alarm deadlines are 64-bit CLOCK_MONOTONIC readings in
+ * nanoseconds, so they have sub-second resolution and are not
+ * disturbed when someone sets the wall clock.
+ *
+ * alarm_now and alarm_wall read the program's clock, which is the
+ * system's unless a virtual one has been selected (see
+ * alarm_clock.h): they call "time_now" and "time_wall", which read
+ * CLOCK_MONOTONIC and CLOCK_REALTIME until clock_select replaces
+ * them.
+ */
+#define NSEC_PER_USEC   1000LL
+#define NSEC_PER_MSEC   1000000LL
+#define NSEC_PER_SEC    1000000000LL
+
+extern int64_t (*time_now) (void);
+extern int64_t (*time_wall) (void);
+
+int64_t alarm_now (void);
+
+/*
+ * The wall clock (CLOCK_REALTIME) in nanoseconds, for deadlines
+ * that have to mean the same thing to another process, such as
+ * those in a snapshot.
+ */
+int64_t alarm_wall (void);
+
+/*
+ * The wall clock in seconds, as time (NULL) would read it, for
+ * the timestamps of acknowledgements.
+ */
+time_t alarm_time (void);
+
+/*
+ * CLOCK_MONOTONIC, whatever the program's clock, for timing how
+ * long something really takes.
+ */
+int64_t real_now (void);
+
+/*
+ * Parse a duration such as "5", "5s", "250ms", "100us" or
+ * "10ns" (a bare number is seconds) at the start of "text",
+ * skipping leading white space. The duration must be followed by
+ * white space, the end of the text or a "~" (which introduces a
+ * slack, see alarm_parse.h). Returns a pointer just past it, or
+ * NULL if "text" does not start with a duration.
+ */
+const char *duration_parse (const char *text, int64_t *nsec);
+
+/*
+ * Pick the time at which to fire an alarm that may fire anywhere
+ * from "deadline" to "slack" after it: the time in that window
+ * that is a multiple of the largest possible power of two
+ * nanoseconds. Alarms with overlapping windows of similar slack
+ * mostly get the same time, and so fire in one wakeup. With no
+ * slack, this is "deadline".
+ */
+int64_t deadline_slack (int64_t deadline, int64_t slack);
+
+/*
+ * Format a duration back into the largest unit that represents
+ * it exactly ("5", "250ms", ...).
+ */
+void duration_format (int64_t nsec, char *buffer, size_t size);
+
+#endif
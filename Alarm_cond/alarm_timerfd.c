@@ -0,0 +1,127 @@
+/*
+ * alarm_timerfd.c
+ *
+ * The timerfd timing engine. A single CLOCK_MONOTONIC timerfd is
+ * armed (with an absolute expiry) to the deadline being waited
+ * for, and wakeups write to an eventfd. The waiter sleeps in
+ * epoll_wait on both, with its mutex released.
+ *
+ * Nothing is lost by waiting outside the mutex: an eventfd stays
+ * readable from the write until the waiter reads it, so a wakeup
+ * that comes before epoll_wait still ends the wait. The epoll set
+ * is also a natural place to add other descriptors, so the engine
+ * can be folded into an event loop.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "alarm_engine.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+struct engine_tag {
+    int                 epoll;
+    int                 timer;
+    int                 event;
+    int64_t             armed;          /* timer's expiry, or INT64_MAX */
+};
+
+static void engine_watch (engine_t *engine, int fd)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl (engine->epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+        errno_abort ("Add to epoll");
+}
+
+engine_t *engine_create (void)
+{
+    engine_t *engine;
+
+    engine = (engine_t*)malloc (sizeof (engine_t));
+    if (engine == NULL)
+        errno_abort ("Allocate engine");
+    engine->epoll = epoll_create1 (EPOLL_CLOEXEC);
+    if (engine->epoll == -1)
+        errno_abort ("Create epoll");
+    engine->timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (engine->timer == -1)
+        errno_abort ("Create timerfd");
+    engine->event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->event == -1)
+        errno_abort ("Create eventfd");
+    engine->armed = INT64_MAX;
+    engine_watch (engine, engine->timer);
+    engine_watch (engine, engine->event);
+    return engine;
+}
+
+/*
+ * Arm the timer for "deadline", or disarm it for INT64_MAX. The
+ * timer is only reprogrammed when the deadline changes (which
+ * also discards any expiry of the old setting that was not read).
+ */
+static void engine_arm (engine_t *engine, int64_t deadline)
+{
+    struct itimerspec spec;
+
+    if (deadline == engine->armed)
+        return;
+    memset (&spec, 0, sizeof (spec));
+    if (deadline != INT64_MAX) {
+        spec.it_value.tv_sec = deadline / NSEC_PER_SEC;
+        spec.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+        /*
+         * An all-zero it_value would disarm the timer instead.
+         */
+        if (deadline == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime (engine->timer, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        errno_abort ("Arm timerfd");
+    engine->armed = deadline;
+}
+
+int engine_wait (engine_t *engine, pthread_mutex_t *mutex, int64_t deadline)
+{
+    struct epoll_event events[2];
+    uint64_t value;
+    int count, i, status, result = 0;
+
+    if (deadline < 0)
+        deadline = 0;
+    engine_arm (engine, deadline);
+    status = pthread_mutex_unlock (mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    do
+        count = epoll_wait (engine->epoll, events, 2, -1);
+    while (count == -1 && errno == EINTR);
+    if (count == -1)
+        errno_abort ("Wait on epoll");
+    for (i = 0; i < count; i++) {
+        if (read (events[i].data.fd, &value, sizeof (value)) == -1
+                && errno != EAGAIN)
+            errno_abort ("Read engine fd");
+        if (events[i].data.fd == engine->timer)
+            result = ETIMEDOUT;
+    }
+    status = pthread_mutex_lock (mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    if (result == ETIMEDOUT)
+        engine->armed = INT64_MAX;
+    return result;
+}
+
+void engine_wake (engine_t *engine, pthread_mutex_t *mutex)
+{
+    uint64_t one = 1;
+
+    if (write (engine->event, &one, sizeof (one)) == -1)
+        errno_abort ("Write eventfd");
+}
@@ -0,0 +1,296 @@
+/*
+ * alarm_wheel.c
+ *
+ * A hierarchical timing wheel for pending alarms. Time is cut
+ * into ticks (WHEEL_TICK units of alarm time), and the wheel has
+ * WHEEL_LEVELS levels of WHEEL_SIZE slots each. A slot on level 0
+ * holds the alarms for exactly one tick; a slot on level 1 covers
+ * WHEEL_SIZE ticks, and so on, like the hands of a clock. An
+ * alarm is filed on the lowest level whose slot does not also
+ * contain "now", so insertion is a couple of shifts and a list
+ * push -- O(1) no matter how many alarms are pending.
+ *
+ * With a one millisecond tick the levels span 64ms, 4s, 4.4
+ * minutes, 4.7 hours, 12.4 days and 795 days.
+ *
+ * As the wheel's notion of now advances into an upper-level slot,
+ * that slot is "cascaded": its alarms are refiled on the lower
+ * levels. Each alarm cascades at most WHEEL_LEVELS - 1 times, so
+ * expiry is amortized O(1). Alarms too far away for the top level
+ * sit on an overflow list that is refiled whenever the top level
+ * wraps around.
+ *
+ * Each level keeps a bitmap of its non-empty slots, so finding
+ * the next tick with work to do is a count-trailing-zeros per
+ * level rather than a walk over empty slots. The alarm thread
+ * sleeps until that tick (see queue_next), which is why the
+ * wheel never has to be stepped one tick at a time.
+ *
+ * Slot lists are doubly linked through "link" and "back" so an
+ * alarm can be unlinked without searching for it.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include "alarm_queue.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+#define WHEEL_TICK      NSEC_PER_MSEC   /* one millisecond per tick */
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    6
+#define WHEEL_SPAN      (WHEEL_BITS * WHEEL_LEVELS)
+
+/*
+ * Values of alarm->queue_slot for alarms that are not in a
+ * wheel slot. Slot alarms use level * WHEEL_SIZE + index.
+ */
+#define SLOT_DUE        -1
+#define SLOT_OVERFLOW   -2
+
+struct queue_tag {
+    alarm_t             *slot[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t            occupied[WHEEL_LEVELS];
+    alarm_t             *overflow;
+    alarm_t             *due;           /* expired, in time order */
+    alarm_t             **due_tail;
+    long                due_count;
+    uint64_t            now;            /* the wheel's current tick */
+    long                count;
+};
+
+/*
+ * Round up, so that an alarm never fires before its time.
+ */
+static uint64_t wheel_tick (int64_t time)
+{
+    if (time <= 0)
+        return 0;
+    return ((uint64_t)time + WHEEL_TICK - 1) / WHEEL_TICK;
+}
+
+static void list_push (alarm_t **head, alarm_t *alarm)
+{
+    alarm->link = *head;
+    if (alarm->link != NULL)
+        alarm->link->back = &alarm->link;
+    alarm->back = head;
+    *head = alarm;
+}
+
+/*
+ * File an alarm relative to the wheel's current tick.
+ */
+static void wheel_place (queue_t *queue, alarm_t *alarm)
+{
+    uint64_t tick, diff;
+    int level, index;
+
+    tick = wheel_tick (alarm->time);
+    if (tick <= queue->now) {
+        alarm->queue_slot = SLOT_DUE;
+        alarm->link = NULL;
+        alarm->back = queue->due_tail;
+        *queue->due_tail = alarm;
+        queue->due_tail = &alarm->link;
+        queue->due_count++;
+        return;
+    }
+    /*
+     * The highest bit in which the alarm's tick differs from now
+     * picks the level: every field above it is shared with now,
+     * so the alarm's field on that level is a slot that now has
+     * not reached yet.
+     */
+    diff = tick ^ queue->now;
+    level = (63 - __builtin_clzll (diff)) / WHEEL_BITS;
+    if (level >= WHEEL_LEVELS) {
+        alarm->queue_slot = SLOT_OVERFLOW;
+        list_push (&queue->overflow, alarm);
+        return;
+    }
+    index = (tick >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    alarm->queue_slot = level * WHEEL_SIZE + index;
+    list_push (&queue->slot[level][index], alarm);
+    queue->occupied[level] |= 1ULL << index;
+}
+
+/*
+ * Refile every alarm on a detached list.
+ */
+static void wheel_refile (queue_t *queue, alarm_t *list)
+{
+    alarm_t *next;
+
+    while (list != NULL) {
+        next = list->link;
+        wheel_place (queue, list);
+        list = next;
+    }
+}
+
+/*
+ * The next tick at which something happens: a level 0 slot
+ * expires, an upper slot cascades, or the top level wraps and the
+ * overflow list has to be refiled. UINT64_MAX if the wheel is
+ * empty.
+ */
+static uint64_t wheel_next_event (queue_t *queue)
+{
+    uint64_t bits, base;
+    int level, shift, current;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        shift = level * WHEEL_BITS;
+        current = (queue->now >> shift) & WHEEL_MASK;
+        bits = queue->occupied[level] & ~((2ULL << current) - 1);
+        if (bits != 0) {
+            base = queue->now & ~((1ULL << (shift + WHEEL_BITS)) - 1);
+            return base | ((uint64_t)__builtin_ctzll (bits) << shift);
+        }
+    }
+    if (queue->overflow != NULL)
+        return (queue->now | ((1ULL << WHEEL_SPAN) - 1)) + 1;
+    return UINT64_MAX;
+}
+
+/*
+ * Move the wheel forward to "target", cascading and expiring every
+ * slot it passes on the way. Only ticks with work are visited.
+ */
+static void wheel_advance (queue_t *queue, uint64_t target)
+{
+    uint64_t event;
+    alarm_t *list;
+    int level, index, shift;
+
+    while ((event = wheel_next_event (queue)) <= target) {
+        queue->now = event;
+        if ((event & ((1ULL << WHEEL_SPAN) - 1)) == 0) {
+            list = queue->overflow;
+            queue->overflow = NULL;
+            wheel_refile (queue, list);
+        }
+        /*
+         * Highest level first, so that cascaded alarms land in
+         * the lower slots before those are looked at.
+         */
+        for (level = WHEEL_LEVELS - 1; level >= 0; level--) {
+            shift = level * WHEEL_BITS;
+            if ((event & ((1ULL << shift) - 1)) != 0)
+                continue;
+            index = (event >> shift) & WHEEL_MASK;
+            if (!(queue->occupied[level] & (1ULL << index)))
+                continue;
+            list = queue->slot[level][index];
+            queue->slot[level][index] = NULL;
+            queue->occupied[level] &= ~(1ULL << index);
+            wheel_refile (queue, list);
+        }
+    }
+    if (target > queue->now)
+        queue->now = target;
+}
+
+queue_t *queue_create (void)
+{
+    queue_t *queue;
+
+    queue = (queue_t*)calloc (1, sizeof (queue_t));
+    if (queue == NULL)
+        errno_abort ("Allocate queue");
+    queue->due_tail = &queue->due;
+    queue->now = wheel_tick (alarm_now ());
+    return queue;
+}
+
+void queue_destroy (queue_t *queue)
+{
+    free (queue);
+}
+
+void queue_insert (queue_t *queue, alarm_t *alarm)
+{
+    wheel_place (queue, alarm);
+    queue->count++;
+}
+
+void queue_remove (queue_t *queue, alarm_t *alarm)
+{
+    int level, index;
+
+    *alarm->back = alarm->link;
+    if (alarm->link != NULL)
+        alarm->link->back = alarm->back;
+    else if (alarm->queue_slot == SLOT_DUE)
+        queue->due_tail = alarm->back;
+    if (alarm->queue_slot == SLOT_DUE)
+        queue->due_count--;
+    if (alarm->queue_slot >= 0) {
+        level = alarm->queue_slot / WHEEL_SIZE;
+        index = alarm->queue_slot % WHEEL_SIZE;
+        if (queue->slot[level][index] == NULL)
+            queue->occupied[level] &= ~(1ULL << index);
+    }
+    queue->count--;
+}
+
+void queue_update (queue_t *queue, alarm_t *alarm)
+{
+    queue_remove (queue, alarm);
+    queue_insert (queue, alarm);
+}
+
+int queue_empty (queue_t *queue)
+{
+    return queue->count == 0;
+}
+
+int64_t queue_next (queue_t *queue)
+{
+    if (queue->due != NULL)
+        return (int64_t)(queue->now * WHEEL_TICK);
+    return (int64_t)(wheel_next_event (queue) * WHEEL_TICK);
+}
+
+/*
+ * Advancing the wheel collects everything due on the due list,
+ * already in time order, so handing it over is O(1).
+ */
+alarm_t *queue_expire (queue_t *queue, int64_t now)
+{
+    alarm_t *due;
+
+    wheel_advance (queue, now > 0 ? (uint64_t)now / WHEEL_TICK : 0);
+    due = queue->due;
+    queue->count -= queue->due_count;
+    queue->due = NULL;
+    queue->due_tail = &queue->due;
+    queue->due_count = 0;
+    return due;
+}
+
+#ifdef DEBUG
+void queue_dump (queue_t *queue)
+{
+    alarm_t *next;
+    int level, index;
+
+    printf ("[wheel @%llu: ", (unsigned long long)queue->now);
+    for (next = queue->due; next != NULL; next = next->link)
+        printf ("due[\"%s\"] ", next->body->message);
+    for (level = 0; level < WHEEL_LEVELS; level++)
+        for (index = 0; index < WHEEL_SIZE; index++)
+            for (next = queue->slot[level][index];
+                    next != NULL; next = next->link)
+                printf ("%d.%d:%lld(%lld)[\"%s\"] ", level, index,
+                    (long long)next->time,
+                    (long long)(next->time - alarm_now ()),
+                    next->body->message);
+    for (next = queue->overflow; next != NULL; next = next->link)
+        printf ("overflow:%lld[\"%s\"] ", (long long)next->time,
+            next->body->message);
+    printf ("]\n");
+}
+#endif
@@ -0,0 +1,120 @@
+/*
+ * bench_jitter.c
+ *
+ * Measure the timing engine the program was built with (see
+ * alarm_engine.h). Two things are timed, each "count" times:
+ *
+ *      timer   sleep until a deadline a random 0-"spread" into the
+ *              future and record how late the wakeup was
+ *      wake    another thread calls engine_wake; record how long
+ *              the waiter took to notice
+ *
+ * Usage: bench_jitter [count [spread-usec]]
+ *
+ * The Makefile's "bench" target builds one copy per engine
+ * (bench_jitter_condvar, bench_jitter_timerfd) for comparison.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "alarm_engine.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static engine_t *bench_engine;
+static int64_t bench_sent;              /* when the wake was sent */
+static int bench_done;
+
+static int compare (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report (const char *what, int64_t *sample, int count)
+{
+    int64_t total = 0;
+    int i;
+
+    qsort (sample, count, sizeof (int64_t), compare);
+    for (i = 0; i < count; i++)
+        total += sample[i];
+    printf ("%-6s mean %7.1fus  p50 %7.1fus  p99 %7.1fus  p99.9 %7.1fus  max %7.1fus\n",
+        what, (double)total / count / NSEC_PER_USEC,
+        (double)sample[count / 2] / NSEC_PER_USEC,
+        (double)sample[(int)(count * 0.99)] / NSEC_PER_USEC,
+        (double)sample[(int)(count * 0.999)] / NSEC_PER_USEC,
+        (double)sample[count - 1] / NSEC_PER_USEC);
+}
+
+/*
+ * Wake the main thread every millisecond or so, stamping the time
+ * of each wake in bench_sent.
+ */
+static void *waker (void *arg)
+{
+    struct timespec pause = {0, NSEC_PER_MSEC};
+
+    while (!__atomic_load_n (&bench_done, __ATOMIC_ACQUIRE)) {
+        nanosleep (&pause, NULL);
+        __atomic_store_n (&bench_sent, alarm_now (), __ATOMIC_RELEASE);
+        engine_wake (bench_engine, &bench_mutex);
+    }
+    return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+    pthread_t thread;
+    int64_t *sample, deadline, sent, spread;
+    int count, i, status;
+
+    count = argc > 1 ? atoi (argv[1]) : 2000;
+    spread = (argc > 2 ? atoll (argv[2]) : 1000) * NSEC_PER_USEC;
+    if (count < 1 || spread < 1) {
+        fprintf (stderr, "Usage: %s [count [spread-usec]]\n", argv[0]);
+        exit (1);
+    }
+    sample = (int64_t*)malloc (count * sizeof (int64_t));
+    if (sample == NULL)
+        errno_abort ("Allocate samples");
+    bench_engine = engine_create ();
+    srandom (1);
+
+    status = pthread_mutex_lock (&bench_mutex);
+    if (status != 0)
+        err_abort (status, "Lock mutex");
+    for (i = 0; i < count; i++) {
+        deadline = alarm_now () + random () % spread;
+        while (engine_wait (bench_engine, &bench_mutex, deadline) != ETIMEDOUT)
+            ;
+        sample[i] = alarm_now () - deadline;
+    }
+    report ("timer", sample, count);
+
+    /*
+     * The waker runs unsynchronized with the waits, so a wait may
+     * begin after the wake it is woken by; those samples (where
+     * nothing was sent since the previous one) are retried.
+     */
+    status = pthread_create (&thread, NULL, waker, NULL);
+    if (status != 0)
+        err_abort (status, "Create waker");
+    sent = 0;
+    for (i = 0; i < count; ) {
+        engine_wait (bench_engine, &bench_mutex, INT64_MAX);
+        deadline = __atomic_load_n (&bench_sent, __ATOMIC_ACQUIRE);
+        if (deadline == sent)
+            continue;
+        sent = deadline;
+        sample[i++] = alarm_now () - sent;
+    }
+    __atomic_store_n (&bench_done, 1, __ATOMIC_RELEASE);
+    status = pthread_mutex_unlock (&bench_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock mutex");
+    pthread_join (thread, NULL);
+    report ("wake", sample, count);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * bench_parse.c
+ *
+ * Time command_scan (see alarm_parse.h) against the sscanf parsing
+ * it replaced, on a generated corpus of "count" lines: 70% set
+ * commands with assorted durations, 20% cancels and 10% bad
+ * lines.
+ *
+ * Usage: bench_parse [count]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "alarm_parse.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+/*
+ * The old way: a set command first, then a cancel. Returns the
+ * same verbs as command_scan.
+ */
+static int sscanf_parse (const char *line, int64_t *interval, int *number,
+    char *message)
+{
+    const char *rest;
+
+    rest = duration_parse (line, interval);
+    if (rest != NULL && sscanf (rest, " Message(%d) %63[^\n]",
+            number, message) == 2)
+        return COMMAND_SET;
+    if (sscanf (line, "Cancel: Message(%d)", number) == 1)
+        return COMMAND_CANCEL;
+    return COMMAND_BAD;
+}
+
+int main (int argc, char *argv[])
+{
+    static const char *units[] = {"", "s", "ms", "us"};
+    static const char *bad[] = {"hello", "5 Mesage(1) x", "Cancel Message(3)", "12ms"};
+    char **lines, message[64];
+    command_t command;
+    int64_t start, scanf_time, scan_time, interval;
+    long sets[2] = {0, 0}, checksum[2] = {0, 0};
+    int count, i, kind, number;
+
+    count = argc > 1 ? atoi (argv[1]) : 1000000;
+    if (count < 1) {
+        fprintf (stderr, "Usage: %s [count]\n", argv[0]);
+        exit (1);
+    }
+    lines = (char**)malloc (count * sizeof (char*));
+    if (lines == NULL)
+        errno_abort ("Allocate corpus");
+    srandom (1);
+    for (i = 0; i < count; i++) {
+        lines[i] = (char*)malloc (128);
+        if (lines[i] == NULL)
+            errno_abort ("Allocate corpus");
+        kind = random () % 10;
+        if (kind < 7)
+            snprintf (lines[i], 128, "%ld%s Message(%ld) Wake up, alarm %d\n",
+                random () % 1000, units[random () % 4], random () % 100000, i);
+        else if (kind < 9)
+            snprintf (lines[i], 128, "Cancel: Message(%ld)\n", random () % 100000);
+        else
+            snprintf (lines[i], 128, "%s\n", bad[random () % 4]);
+    }
+
+    start = alarm_now ();
+    for (i = 0; i < count; i++)
+        if (sscanf_parse (lines[i], &interval, &number, message) == COMMAND_SET) {
+            sets[0]++;
+            checksum[0] += number + interval + strlen (message);
+        }
+    scanf_time = alarm_now () - start;
+
+    start = alarm_now ();
+    for (i = 0; i < count; i++)
+        if (command_scan (lines[i], &command) == COMMAND_SET) {
+            sets[1]++;
+            checksum[1] += command.number + command.interval + command.length;
+        }
+    scan_time = alarm_now () - start;
+
+    printf ("sscanf        %7.1f ns/line\n", (double)scanf_time / count);
+    printf ("command_scan  %7.1f ns/line  (%.1fx)\n", (double)scan_time / count,
+        (double)scanf_time / scan_time);
+    if (sets[0] != sets[1] || checksum[0] != checksum[1])
+        printf ("Parsers disagree: %ld/%ld sets, checksum %ld/%ld\n",
+            sets[0], sets[1], checksum[0], checksum[1]);
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * bench_queue.c
+ *
+ * Time the pending-alarm operations of the queue the program was
+ * built with (see alarm_queue.h), together with the index updates
+ * that go with them (see alarm_index.h), exactly as an alarm
+ * thread performs them -- but in a single thread, with no locks,
+ * threads or output in the way.
+ *
+ * For each size (10, 100, ... up to "max" pending alarms) and each
+ * deadline distribution, it times:
+ *
+ *      insert  queue "size" alarms
+ *      replace give "size" / 2 random pending alarms a new deadline
+ *      cancel  remove "size" / 4 random pending alarms
+ *      expire  advance time and take every remaining alarm as it
+ *              falls due (queue_next then queue_expire), per alarm
+ *
+ * The distributions are:
+ *
+ *      uniform         deadlines spread at random over an hour
+ *      same            every deadline identical
+ *      increasing      each deadline later than the one before
+ *      decreasing      each deadline earlier than the one before
+ *
+ * Each operation is timed on its own, and the mean and the 50th,
+ * 99th and 99.9th percentiles are reported in nanoseconds; the
+ * cost of reading the clock, which is included, is printed first.
+ * A phase that has run for more than PHASE_LIMIT at over SLOW_OP
+ * per operation is cut short and ends that distribution, so that
+ * the sorted list does not run for hours.
+ *
+ * Usage: bench_queue [max]     (default 1000000)
+ *
+ * The Makefile's "bench" target builds one copy per queue
+ * (bench_queue_wheel, bench_queue_heap, bench_queue_list).
+ */
+#include <stdlib.h>
+#include "alarm_queue.h"
+#include "alarm_index.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+#ifndef QUEUE_NAME
+# define QUEUE_NAME     "?"
+#endif
+
+#define SPAN            (3600 * NSEC_PER_SEC)
+#define PHASE_LIMIT     (10 * NSEC_PER_SEC)
+#define SLOW_OP         (10 * NSEC_PER_USEC)
+
+#define UNIFORM         0
+#define SAME            1
+#define INCREASING      2
+#define DECREASING      3
+
+static const char *dist_name[] = {"uniform", "same", "increasing", "decreasing"};
+
+static uint64_t bench_seed = 88172645463325252ULL;
+static int64_t *bench_sample;
+
+/*
+ * xorshift64: cheap enough not to show in the timings.
+ */
+static uint64_t bench_random (void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+/*
+ * The "i"th of "count" deadlines of a distribution, after "base".
+ */
+static int64_t deadline (int dist, long i, long count, int64_t base)
+{
+    int64_t step = SPAN / count > 0 ? SPAN / count : 1;
+
+    switch (dist) {
+    case UNIFORM:
+        return base + bench_random () % SPAN;
+    case SAME:
+        return base + SPAN / 2;
+    case INCREASING:
+        return base + i * step;
+    default:
+        return base + (count - i) * step;
+    }
+}
+
+static int too_slow (int64_t total, long count)
+{
+    return total > PHASE_LIMIT && total / count > SLOW_OP;
+}
+
+static int compare (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Summarize "count" samples taking "total" nanoseconds. Returns
+ * non-zero if the phase was too slow (and so was cut short).
+ */
+static int report (long size, int dist, const char *op, long count, int64_t total)
+{
+    if (count == 0)
+        return 0;
+    qsort (bench_sample, count, sizeof (int64_t), compare);
+    printf ("%-6s %9ld  %-10s  %-7s  %9.1f %8lld %8lld %8lld%s\n",
+        QUEUE_NAME, size, dist_name[dist], op, (double)total / count,
+        (long long)bench_sample[count / 2],
+        (long long)bench_sample[(long)(count * 0.99)],
+        (long long)bench_sample[(long)(count * 0.999)],
+        too_slow (total, count) ? "  (too slow, stopped)" : "");
+    fflush (stdout);
+    return too_slow (total, count);
+}
+
+/*
+ * Run every phase for one size and distribution. Returns non-zero
+ * if a phase was too slow; the rest are then skipped, and
+ * the queue and index (still holding alarms) are abandoned.
+ */
+static int bench (long size, int dist, alarm_t *alarm)
+{
+    queue_t *queue;
+    index_t *index;
+    alarm_t *due, *next;
+    int64_t base, start, end, now, total;
+    long i, j, count, live, batch;
+
+    queue = queue_create ();
+    index = index_create ();
+    base = alarm_now ();
+    total = 0;
+    for (i = 0; i < size; i++) {
+        alarm[i].Message_Number = i;
+        alarm[i].time = deadline (dist, i, size, base);
+        start = alarm_now ();
+        queue_insert (queue, &alarm[i]);
+        index_insert (index, &alarm[i]);
+        end = alarm_now ();
+        bench_sample[i] = end - start;
+        total += end - start;
+        if (too_slow (total, i + 1))
+            return report (size, dist, "insert", i + 1, total);
+    }
+    report (size, dist, "insert", size, total);
+
+    total = 0;
+    count = size / 2;
+    for (j = 0; j < count; j++) {
+        i = bench_random () % size;
+        start = alarm_now ();
+        alarm[i].time = deadline (dist, size + j, size + count, base);
+        queue_update (queue, index_find (index, i));
+        end = alarm_now ();
+        bench_sample[j] = end - start;
+        total += end - start;
+        if (too_slow (total, j + 1))
+            return report (size, dist, "replace", j + 1, total);
+    }
+    report (size, dist, "replace", count, total);
+
+    /*
+     * Cancel a random quarter: pick from the alarms not yet
+     * cancelled by swapping them to the end of the array.
+     */
+    total = 0;
+    count = size / 4;
+    live = size;
+    for (j = 0; j < count; j++) {
+        i = bench_random () % live;
+        start = alarm_now ();
+        next = index_find (index, alarm[i].Message_Number);
+        queue_remove (queue, next);
+        index_remove (index, next);
+        end = alarm_now ();
+        bench_sample[j] = end - start;
+        total += end - start;
+        if (too_slow (total, j + 1))
+            return report (size, dist, "cancel", j + 1, total);
+        live--;
+        if (i != live) {
+            /*
+             * The alarms are moving in memory, so the index
+             * and the queue must be told: take the last live
+             * alarm out, move it into the hole and put it back
+             * (untimed).
+             */
+            next = &alarm[live];
+            queue_remove (queue, next);
+            index_remove (index, next);
+            alarm[i] = *next;
+            queue_insert (queue, &alarm[i]);
+            index_insert (index, &alarm[i]);
+        }
+    }
+    report (size, dist, "cancel", count, total);
+
+    /*
+     * Drain what is left, jumping straight to each time the queue
+     * next has work. A call's cost is shared among the alarms it
+     * returns.
+     */
+    total = 0;
+    count = 0;
+    now = base;
+    while (!queue_empty (queue)) {
+        start = alarm_now ();
+        due = queue_expire (queue, now);
+        batch = 0;
+        for (next = due; next != NULL; next = next->link) {
+            index_remove (index, next);
+            batch++;
+        }
+        if (due == NULL)
+            now = queue_next (queue);
+        end = alarm_now ();
+        total += end - start;
+        if (batch == 0)
+            continue;
+        for (j = 0; j < batch; j++)
+            bench_sample[count + j] = (end - start) / batch;
+        count += batch;
+        if (too_slow (total, count))
+            return report (size, dist, "expire", count, total);
+    }
+    report (size, dist, "expire", count, total);
+    queue_destroy (queue);
+    index_destroy (index);
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    alarm_t *alarm;
+    int64_t start, overhead;
+    long max, size;
+    int dist, i, done[4] = {0, 0, 0, 0};
+
+    max = argc > 1 ? atol (argv[1]) : 1000000;
+    if (max < 10) {
+        fprintf (stderr, "Usage: %s [max]\n", argv[0]);
+        exit (1);
+    }
+    alarm = (alarm_t*)calloc (max, sizeof (alarm_t));
+    bench_sample = (int64_t*)malloc (max * sizeof (int64_t));
+    if (alarm == NULL || bench_sample == NULL)
+        errno_abort ("Allocate alarms");
+
+    start = alarm_now ();
+    for (i = 0; i < 1000000; i++)
+        alarm_now ();
+    overhead = (alarm_now () - start) / 1000000;
+    printf ("Clock read: %lld ns (included in every figure)\n", (long long)overhead);
+    printf ("%-6s %9s  %-10s  %-7s  %9s %8s %8s %8s\n",
+        "queue", "size", "deadlines", "op", "ns/op", "p50", "p99", "p99.9");
+    for (size = 10; size <= max; size *= 10)
+        for (dist = 0; dist < 4; dist++) {
+            if (done[dist])
+                continue;
+            done[dist] = bench (size, dist, alarm);
+        }
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * bench_rwlock.c
+ *
+ * Measure how lookups of pending alarms (what a Query does, see
+ * alarm_query.h) scale with the number of reader threads: inside
+ * an epoch with no lock (see alarm_epoch.h), as the readers do,
+ * and for comparison under the system's readers-writer lock
+ * (pthread_rwlock_t) and under a plain mutex. A writer thread stands
+ * in for the alarm thread: every 100us it takes the lock for
+ * writing, if there is one, and replaces a few alarms in the
+ * index. Its waits for the lock show how much readers hold it up.
+ *
+ * Usage: bench_rwlock [seconds [alarms]]
+ *
+ * Each configuration runs for "seconds" (default 1) against an
+ * index of "alarms" (default 100000) pending alarms.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include "alarm_index.h"
+#include "alarm_epoch.h"
+#include "alarm_time.h"
+#include "errors.h"
+
+#define WRITE_BATCH     16              /* replacements per write */
+#define MAX_WAITS       100000
+
+#define MODE_EPOCH      0
+#define MODE_RWLOCK     1
+#define MODE_MUTEX      2
+
+static index_t *bench_index;
+static alarm_t *bench_alarm;
+static int bench_count;
+static int bench_mode;
+static pthread_rwlock_t bench_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int bench_done;
+static int64_t bench_wait[MAX_WAITS];
+static int bench_waits;
+
+static void read_lock (void)
+{
+    if (bench_mode == MODE_EPOCH)
+        epoch_enter ();
+    else if (bench_mode == MODE_RWLOCK)
+        pthread_rwlock_rdlock (&bench_rwlock);
+    else
+        pthread_mutex_lock (&bench_mutex);
+}
+
+static void read_unlock (void)
+{
+    if (bench_mode == MODE_EPOCH)
+        epoch_exit ();
+    else if (bench_mode == MODE_RWLOCK)
+        pthread_rwlock_unlock (&bench_rwlock);
+    else
+        pthread_mutex_unlock (&bench_mutex);
+}
+
+static void write_lock (void)
+{
+    if (bench_mode == MODE_RWLOCK)
+        pthread_rwlock_wrlock (&bench_rwlock);
+    else if (bench_mode == MODE_MUTEX)
+        pthread_mutex_lock (&bench_mutex);
+}
+
+static void write_unlock (void)
+{
+    if (bench_mode == MODE_RWLOCK)
+        pthread_rwlock_unlock (&bench_rwlock);
+    else if (bench_mode == MODE_MUTEX)
+        pthread_mutex_unlock (&bench_mutex);
+}
+
+static int compare (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Look up random alarms until told to stop; returns the count.
+ * Without a lock, a lookup may miss an alarm that the writer is
+ * replacing, as a Query may.
+ */
+static void *reader (void *arg)
+{
+    unsigned int seed = (unsigned int)(intptr_t)arg;
+    long lookups = 0, found = 0;
+
+    while (!__atomic_load_n (&bench_done, __ATOMIC_RELAXED)) {
+        read_lock ();
+        if (index_find (bench_index, rand_r (&seed) % bench_count) != NULL)
+            found++;
+        read_unlock ();
+        lookups++;
+    }
+    return (void*)(intptr_t)(found == lookups || bench_mode == MODE_EPOCH
+        ? lookups : -1);
+}
+
+static void *writer (void *arg)
+{
+    struct timespec pause = {0, 100 * NSEC_PER_USEC};
+    unsigned int seed = 1;
+    alarm_t *alarm;
+    int64_t start;
+    int i;
+
+    while (!__atomic_load_n (&bench_done, __ATOMIC_RELAXED)) {
+        nanosleep (&pause, NULL);
+        start = alarm_now ();
+        write_lock ();
+        if (bench_waits < MAX_WAITS)
+            bench_wait[bench_waits++] = alarm_now () - start;
+        for (i = 0; i < WRITE_BATCH; i++) {
+            alarm = &bench_alarm[rand_r (&seed) % bench_count];
+            index_remove (bench_index, alarm);
+            index_insert (bench_index, alarm);
+        }
+        write_unlock ();
+    }
+    return NULL;
+}
+
+static void run (int readers, double seconds)
+{
+    pthread_t thread[16], write_thread;
+    struct timespec pause;
+    void *result;
+    long lookups = 0;
+    int i, status;
+
+    bench_done = 0;
+    bench_waits = 0;
+    status = pthread_create (&write_thread, NULL, writer, NULL);
+    if (status != 0)
+        err_abort (status, "Create writer");
+    for (i = 0; i < readers; i++) {
+        status = pthread_create (&thread[i], NULL, reader, (void*)(intptr_t)(i + 1));
+        if (status != 0)
+            err_abort (status, "Create reader");
+    }
+    pause.tv_sec = (time_t)seconds;
+    pause.tv_nsec = (long)((seconds - pause.tv_sec) * NSEC_PER_SEC);
+    nanosleep (&pause, NULL);
+    __atomic_store_n (&bench_done, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < readers; i++) {
+        pthread_join (thread[i], &result);
+        if ((intptr_t)result < 0) {
+            fprintf (stderr, "Lookup missed a pending alarm\n");
+            exit (1);
+        }
+        lookups += (intptr_t)result;
+    }
+    pthread_join (write_thread, NULL);
+    qsort (bench_wait, bench_waits, sizeof (int64_t), compare);
+    printf ("%-7s %7d %12.0f %8d %9.1f %9.1f %9.1f\n",
+        bench_mode == MODE_EPOCH ? "epoch"
+        : bench_mode == MODE_RWLOCK ? "rwlock" : "mutex", readers, lookups / seconds,
+        bench_waits,
+        bench_waits > 0 ? (double)bench_wait[bench_waits / 2] / NSEC_PER_USEC : 0.0,
+        bench_waits > 0 ? (double)bench_wait[(int)(bench_waits * 0.99)] / NSEC_PER_USEC : 0.0,
+        bench_waits > 0 ? (double)bench_wait[bench_waits - 1] / NSEC_PER_USEC : 0.0);
+}
+
+int main (int argc, char *argv[])
+{
+    static const int readers[] = {1, 2, 4, 8, 16};
+    double seconds;
+    int i;
+
+    seconds = argc > 1 ? atof (argv[1]) : 1.0;
+    bench_count = argc > 2 ? atoi (argv[2]) : 100000;
+    if (seconds <= 0 || bench_count < 1) {
+        fprintf (stderr, "Usage: %s [seconds [alarms]]\n", argv[0]);
+        exit (1);
+    }
+    bench_alarm = (alarm_t*)calloc (bench_count, sizeof (alarm_t));
+    if (bench_alarm == NULL)
+        errno_abort ("Allocate alarms");
+    bench_index = index_create ();
+    for (i = 0; i < bench_count; i++) {
+        bench_alarm[i].Message_Number = i;
+        index_insert (bench_index, &bench_alarm[i]);
+    }
+    printf ("%ld CPUs online, %d alarms\n", sysconf (_SC_NPROCESSORS_ONLN), bench_count);
+    printf ("lock    readers    lookups/s   writes   wait p50    p99 us    max us\n");
+    for (bench_mode = MODE_EPOCH; bench_mode <= MODE_MUTEX; bench_mode++)
+        for (i = 0; i < (int)(sizeof (readers) / sizeof (readers[0])); i++)
+            run (readers[i], seconds);
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * bench_server.c
+ *
+ * Socket server benchmark. It opens many connections to the alarm
+ * program's socket (see alarm_server.h), has every connection set
+ * alarms of its own, and checks that each expiry comes back on the
+ * connection that set it, reporting how long connecting took, how
+ * fast expiries came back and how late they were.
+ *
+ * Every alarm's message is "c<connection>@<deadline>", with the
+ * deadline a CLOCK_MONOTONIC reading as in loadgen.c, so each
+ * expiry line says where it should have gone and how late it is.
+ *
+ * Unless -s names the socket of a server that is already running,
+ * the alarm program is started with "--listen" on a temporary
+ * socket and stopped with SIGTERM at the end.
+ *
+ * Usage: bench_server [-c connections] [-n alarms] [-d min-max]
+ *                     [-b alarms] [-s socket] [-p program]
+ *                     [-- program options]
+ *
+ *      -c      connections (default 1000)
+ *      -n      alarms per connection (default 10)
+ *      -b      one more connection sets this many alarms first and
+ *              never reads its socket (default 0, none); the others
+ *              should not be held up by it
+ *      -d      alarm delays in milliseconds (default 200-1000)
+ *      -s      socket of a running server
+ *      -p      the alarm program (default ./a.out)
+ */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "alarm_time.h"
+#include "errors.h"
+
+#define GRACE           (2 * NSEC_PER_SEC)
+#define CONNECT_WAIT    (5 * NSEC_PER_SEC) /* for a server to start */
+#define BUFFER          8192
+
+typedef struct connection_tag {
+    int                 fd;
+    int                 held;
+    char                buffer[BUFFER];
+} connection_t;
+
+static uint64_t bench_seed = 88172645463325252ULL;
+static int64_t *bench_lateness;
+static long bench_acks, bench_fired, bench_misrouted, bench_other;
+
+static uint64_t bench_random (void)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+static int compare (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Classify one line that arrived on connection "index".
+ */
+static void bench_line (int index, const char *line, int64_t now)
+{
+    const char *tag;
+    long long deadline;
+    int owner;
+
+    if (strncmp (line, "Alarm Request Received", 22) == 0) {
+        bench_acks++;
+        return;
+    }
+    tag = strstr (line, ") c");
+    if (tag == NULL || sscanf (tag + 3, "%d@%lld", &owner, &deadline) != 2) {
+        bench_other++;
+        return;
+    }
+    if (owner != index) {
+        bench_misrouted++;
+        return;
+    }
+    bench_lateness[bench_fired++] = now - deadline;
+}
+
+static int bench_connect (const char *path)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strncpy (address.sun_path, path, sizeof (address.sun_path) - 1);
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        errno_abort ("Create socket");
+    if (connect (fd, (struct sockaddr*)&address, sizeof (address)) == -1) {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Send "count" alarms with delays from "delay_min" to "delay_max"
+ * milliseconds on "fd", tagged with connection "index". Returns -1
+ * if the server has closed the connection.
+ */
+static int bench_send (int fd, int index, int count, long delay_min,
+    long delay_max, long *number, int64_t *last_deadline)
+{
+    char out[BUFFER], *p = out;
+    int64_t now, interval, deadline;
+    int k;
+
+    now = alarm_now ();
+    for (k = 0; k < count; k++) {
+        interval = (delay_min + (int64_t)(bench_random () % (delay_max - delay_min + 1)))
+            * NSEC_PER_MSEC;
+        deadline = now + interval;
+        if (deadline > *last_deadline)
+            *last_deadline = deadline;
+        p += snprintf (p, out + sizeof (out) - p, "%lldms Message(%ld) c%d@%lld\n",
+            (long long)(interval / NSEC_PER_MSEC), (*number)++, index, (long long)deadline);
+        if (out + sizeof (out) - p < 80 || k == count - 1) {
+            if (write (fd, out, p - out) != p - out) {
+                if (errno == EPIPE || errno == ECONNRESET)
+                    return -1;
+                errno_abort ("Write commands");
+            }
+            p = out;
+        }
+    }
+    return 0;
+}
+
+static void usage (char *program)
+{
+    fprintf (stderr, "Usage: %s [-c connections] [-n alarms] [-d min-max] [-b alarms]\n"
+        "       [-s socket] [-p program] [-- program options]\n", program);
+    exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+    char *program = "./a.out", *path = NULL, **child_argv;
+    char socket_path[64], listen_arg[80], *line, *newline;
+    connection_t *connection, *c;
+    struct epoll_event event, events[256];
+    struct rlimit limit;
+    pid_t pid = 0;
+    int option, i, k, epoll, ready, count = 1000, per = 10;
+    int stuck = 0, stuck_fd = -1, stuck_owed = 0;
+    long delay_min = 200, delay_max = 1000, total, number;
+    int64_t start, connected, sent, now, last_deadline = 0;
+    int64_t first_fire = 0, last_fire = 0;
+    ssize_t got;
+
+    while ((option = getopt (argc, argv, "c:n:d:b:s:p:")) != -1) {
+        switch (option) {
+        case 'c':
+            count = atoi (optarg);
+            break;
+        case 'n':
+            per = atoi (optarg);
+            break;
+        case 'd':
+            if (sscanf (optarg, "%ld-%ld", &delay_min, &delay_max) != 2)
+                usage (argv[0]);
+            break;
+        case 'b':
+            stuck = atoi (optarg);
+            break;
+        case 's':
+            path = optarg;
+            break;
+        case 'p':
+            program = optarg;
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (count < 1 || per < 1 || stuck < 0 || delay_min < 0 || delay_max < delay_min)
+        usage (argv[0]);
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &limit);
+    }
+    signal (SIGPIPE, SIG_IGN);
+
+    /*
+     * Start a server of our own, with the rest of the arguments.
+     */
+    if (path == NULL) {
+        snprintf (socket_path, sizeof (socket_path), "/tmp/bench_server.%d", (int)getpid ());
+        snprintf (listen_arg, sizeof (listen_arg), "--listen=%s", socket_path);
+        path = socket_path;
+        child_argv = (char**)calloc (argc - optind + 3, sizeof (char*));
+        if (child_argv == NULL)
+            errno_abort ("Allocate arguments");
+        child_argv[0] = program;
+        child_argv[1] = listen_arg;
+        for (i = optind; i < argc; i++)
+            child_argv[i - optind + 2] = argv[i];
+        pid = fork ();
+        if (pid == -1)
+            errno_abort ("Fork");
+        if (pid == 0) {
+            execvp (program, child_argv);
+            errno_abort ("Start alarm program");
+        }
+    }
+
+    connection = (connection_t*)calloc (count, sizeof (connection_t));
+    total = (long)count * per;
+    bench_lateness = (int64_t*)malloc (total * sizeof (int64_t));
+    if (connection == NULL || bench_lateness == NULL)
+        errno_abort ("Allocate");
+    epoll = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll == -1)
+        errno_abort ("Create epoll");
+
+    /*
+     * Connect everyone, waiting for our own server to come up.
+     */
+    start = alarm_now ();
+    while ((connection[0].fd = bench_connect (path)) == -1) {
+        struct timespec pause = {0, 10 * NSEC_PER_MSEC};
+
+        if (pid == 0 || alarm_now () - start > CONNECT_WAIT)
+            errno_abort ("Connect to server");
+        nanosleep (&pause, NULL);
+    }
+    start = alarm_now ();
+    for (i = 1; i < count; i++)
+        if ((connection[i].fd = bench_connect (path)) == -1)
+            errno_abort ("Connect to server");
+    connected = alarm_now ();
+    for (i = 0; i < count; i++) {
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        if (epoll_ctl (epoll, EPOLL_CTL_ADD, connection[i].fd, &event) == -1)
+            errno_abort ("Add connection to epoll");
+    }
+
+    /*
+     * The connection that never reads goes first, so that its
+     * acknowledgements and expiries are ahead of everyone else's.
+     */
+    number = 1;
+    if (stuck > 0) {
+        if ((stuck_fd = bench_connect (path)) == -1)
+            errno_abort ("Connect to server");
+        bench_send (stuck_fd, -1, stuck, delay_min, delay_max, &number, &last_deadline);
+    }
+
+    /*
+     * Each connection sends all of its alarms in one write.
+     */
+    for (i = 0; i < count; i++)
+        if (bench_send (connection[i].fd, i, per, delay_min, delay_max, &number,
+                &last_deadline) == -1)
+            errno_abort ("Write commands");
+    sent = alarm_now ();
+
+    /*
+     * Collect acknowledgements and expiries until every alarm has
+     * come back, or the grace period after the last deadline ends.
+     */
+    while (bench_fired + bench_misrouted < total
+            && (now = alarm_now ()) < last_deadline + GRACE) {
+        ready = epoll_wait (epoll, events, 256, 100);
+        now = alarm_now ();
+        for (k = 0; k < ready; k++) {
+            c = &connection[events[k].data.u32];
+            got = read (c->fd, c->buffer + c->held, BUFFER - 1 - c->held);
+            if (got <= 0) {
+                epoll_ctl (epoll, EPOLL_CTL_DEL, c->fd, NULL);
+                continue;
+            }
+            c->held += got;
+            c->buffer[c->held] = '\0';
+            line = c->buffer;
+            while ((newline = strchr (line, '\n')) != NULL) {
+                *newline = '\0';
+                bench_line (events[k].data.u32, line, now);
+                line = newline + 1;
+            }
+            c->held = c->buffer + c->held - line;
+            memmove (c->buffer, line, c->held);
+        }
+        if (ready > 0 && bench_fired > 0) {
+            if (first_fire == 0)
+                first_fire = now;
+            last_fire = now;
+        }
+    }
+    for (i = 0; i < count; i++)
+        close (connection[i].fd);
+
+    /*
+     * Whatever the server sent the connection that never read is
+     * still waiting in its socket; an end of file after it means
+     * the server gave up on it.
+     */
+    if (stuck_fd != -1) {
+        char buffer[BUFFER];
+
+        fcntl (stuck_fd, F_SETFL, O_NONBLOCK);
+        while ((got = read (stuck_fd, buffer, sizeof (buffer))) > 0)
+            stuck_owed += got;
+        printf ("Client that never read: %d bytes waiting, %s\n",
+            stuck_owed, got == 0 ? "disconnected" : "still connected");
+        close (stuck_fd);
+    }
+    if (pid != 0) {
+        kill (pid, SIGTERM);
+        waitpid (pid, NULL, 0);
+    }
+
+    printf ("Connected %d clients in %.3fs, sent %ld alarms in %.3fs\n",
+        count, (double)(connected - start) / NSEC_PER_SEC, total,
+        (double)(sent - connected) / NSEC_PER_SEC);
+    printf ("Acknowledged %ld, fired %ld of %ld, %ld to the wrong client, %ld other lines\n",
+        bench_acks, bench_fired, total, bench_misrouted, bench_other);
+    if (bench_fired > 0) {
+        qsort (bench_lateness, bench_fired, sizeof (int64_t), compare);
+        printf ("Lateness: p50 %.3fms, p99 %.3fms, p99.9 %.3fms, max %.3fms\n",
+            (double)bench_lateness[bench_fired / 2] / NSEC_PER_MSEC,
+            (double)bench_lateness[(long)(bench_fired * 0.99)] / NSEC_PER_MSEC,
+            (double)bench_lateness[(long)(bench_fired * 0.999)] / NSEC_PER_MSEC,
+            (double)bench_lateness[bench_fired - 1] / NSEC_PER_MSEC);
+    }
+    return bench_fired == total ? 0 : 1;
+}
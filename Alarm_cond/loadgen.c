@@ -0,0 +1,342 @@
+/*
+ * loadgen.c
+ *
+ * End-to-end load generator. It starts the alarm program with its
+ * standard input and output on pipes, feeds it commands at a set
+ * rate for a set time, reads back the expired alarms and reports
+ * how many were scheduled and how late they were delivered.
+ *
+ * Every alarm's message is "lg<seq>@<deadline>", where <deadline>
+ * is the loadgen's CLOCK_MONOTONIC reading (the same clock the
+ * alarm program uses) at which it should fire, so each expiry
+ * line carries what is needed to work out its own lateness. The
+ * lateness measured is end to end: it includes the time a command
+ * spends in the pipe and being parsed, and the time the expired
+ * alarm spends being written back.
+ *
+ * Of the commands, a share are cancels and a share replace a
+ * pending alarm with a new deadline; the rest set new alarms.
+ * Cancels and replacements only pick alarms that are at least
+ * SAFE_MARGIN from firing, so that they never race the expiry and
+ * the number of alarms that should fire is known.
+ *
+ * Usage: loadgen [-r rate] [-t seconds] [-d min-max] [-c cancel%]
+ *                [-R replace%] [-p program] [-- program options]
+ *
+ *      -r      commands per second (default 10000)
+ *      -t      how long to send for (default 10)
+ *      -d      alarm delays in milliseconds (default 10-1000)
+ *      -c, -R  percentage of cancels and replacements (default 10)
+ *      -p      the alarm program (default ./a.out)
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "alarm_time.h"
+#include "errors.h"
+
+#define SAFE_MARGIN     (100 * NSEC_PER_MSEC)
+#define SEND_TICK       NSEC_PER_MSEC   /* how often to send */
+#define GRACE           (2 * NSEC_PER_SEC)
+
+typedef struct live_tag {
+    int                 number;
+    int64_t             deadline;
+} live_t;
+
+static uint64_t gen_seed = 88172645463325252ULL;
+
+/*
+ * What the reader thread has seen.
+ */
+static pthread_mutex_t gen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gen_cond = PTHREAD_COND_INITIALIZER;
+static int64_t *gen_lateness;
+static long gen_fired, gen_size;
+static long gen_acks, gen_replaced, gen_cancelled;
+
+static uint64_t gen_random (void)
+{
+    gen_seed ^= gen_seed << 13;
+    gen_seed ^= gen_seed >> 7;
+    gen_seed ^= gen_seed << 17;
+    return gen_seed;
+}
+
+/*
+ * Classify one line of the alarm program's output.
+ */
+static void gen_line (const char *line, int64_t now)
+{
+    const char *tag;
+    long long seq, deadline;
+
+    if (strncmp (line, "Alarm Request Received", 22) == 0)
+        gen_acks++;
+    else if (strncmp (line, "Alarm with Message Number", 25) == 0)
+        gen_replaced++;
+    else if (strncmp (line, "Alarm Cancel Received", 21) == 0)
+        gen_cancelled++;
+    else if ((tag = strstr (line, ") lg")) != NULL
+            && sscanf (tag, ") lg%lld@%lld", &seq, &deadline) == 2) {
+        if (gen_fired == gen_size) {
+            gen_size = gen_size ? gen_size * 2 : 65536;
+            gen_lateness = (int64_t*)realloc (gen_lateness, gen_size * sizeof (int64_t));
+            if (gen_lateness == NULL)
+                errno_abort ("Allocate samples");
+        }
+        gen_lateness[gen_fired++] = now - deadline;
+    }
+}
+
+/*
+ * Read the alarm program's output until it closes it.
+ */
+static void *gen_reader (void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buffer[65536];
+    char *line, *end, *newline;
+    size_t held = 0;
+    ssize_t got;
+    int64_t now;
+    int status;
+
+    while ((got = read (fd, buffer + held, sizeof (buffer) - 1 - held)) != 0) {
+        if (got == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort ("Read output");
+        }
+        now = alarm_now ();
+        held += got;
+        end = buffer + held;
+        status = pthread_mutex_lock (&gen_mutex);
+        if (status != 0)
+            err_abort (status, "Lock");
+        for (line = buffer; (newline = memchr (line, '\n', end - line)) != NULL;
+                line = newline + 1) {
+            *newline = '\0';
+            gen_line (line, now);
+        }
+        status = pthread_cond_signal (&gen_cond);
+        if (status != 0)
+            err_abort (status, "Signal");
+        status = pthread_mutex_unlock (&gen_mutex);
+        if (status != 0)
+            err_abort (status, "Unlock");
+        held = end - line;
+        if (held == sizeof (buffer) - 1)
+            held = 0;           /* no line is that long; drop it */
+        memmove (buffer, line, held);
+    }
+    return NULL;
+}
+
+static int compare (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage (char *program)
+{
+    fprintf (stderr, "Usage: %s [-r rate] [-t seconds] [-d min-max] [-c cancel%%] [-R replace%%]\n"
+        "       [-p program] [-- program options]\n", program);
+    exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+    char *program = "./a.out", **child_argv;
+    char *out, *p;
+    live_t *live, *pick;
+    pthread_t reader;
+    pid_t pid;
+    int to_child[2], from_child[2];
+    int option, i, tries, kind, status;
+    double rate = 10000;
+    long seconds = 10, delay_min = 10, delay_max = 1000;
+    long cancel_pct = 10, replace_pct = 10;
+    long live_count = 0, live_size, seq = 0, next_number = 1;
+    long sets = 0, cancels = 0, replaces = 0, sent = 0, due, expected, out_lines;
+    int64_t start, now, end, deadline, last_deadline = 0, interval, elapsed;
+
+    while ((option = getopt (argc, argv, "r:t:d:c:R:p:")) != -1) {
+        switch (option) {
+        case 'r':
+            rate = atof (optarg);
+            break;
+        case 't':
+            seconds = atol (optarg);
+            break;
+        case 'd':
+            if (sscanf (optarg, "%ld-%ld", &delay_min, &delay_max) != 2)
+                usage (argv[0]);
+            break;
+        case 'c':
+            cancel_pct = atol (optarg);
+            break;
+        case 'R':
+            replace_pct = atol (optarg);
+            break;
+        case 'p':
+            program = optarg;
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (rate <= 0 || seconds < 1 || delay_min < 0 || delay_max < delay_min
+            || cancel_pct < 0 || replace_pct < 0 || cancel_pct + replace_pct > 100)
+        usage (argv[0]);
+
+    /*
+     * Start the program, with the rest of the arguments.
+     */
+    child_argv = (char**)calloc (argc - optind + 2, sizeof (char*));
+    if (child_argv == NULL)
+        errno_abort ("Allocate arguments");
+    child_argv[0] = program;
+    for (i = optind; i < argc; i++)
+        child_argv[i - optind + 1] = argv[i];
+    if (pipe (to_child) == -1 || pipe (from_child) == -1)
+        errno_abort ("Create pipes");
+    signal (SIGPIPE, SIG_IGN);
+    pid = fork ();
+    if (pid == -1)
+        errno_abort ("Fork");
+    if (pid == 0) {
+        dup2 (to_child[0], 0);
+        dup2 (from_child[1], 1);
+        close (to_child[0]);
+        close (to_child[1]);
+        close (from_child[0]);
+        close (from_child[1]);
+        execvp (program, child_argv);
+        errno_abort ("Start alarm program");
+    }
+    close (to_child[0]);
+    close (from_child[1]);
+    status = pthread_create (&reader, NULL, gen_reader, (void*)(intptr_t)from_child[0]);
+    if (status != 0)
+        err_abort (status, "Create reader");
+
+    live_size = (long)(rate * seconds) + 1;
+    live = (live_t*)malloc (live_size * sizeof (live_t));
+    out_lines = (long)(rate * SEND_TICK / NSEC_PER_SEC) * 4 + 16;
+    out = (char*)malloc (out_lines * 80);
+    if (live == NULL || out == NULL)
+        errno_abort ("Allocate");
+
+    /*
+     * Every SEND_TICK, write as many commands as the rate says
+     * should have been sent by now (up to "out_lines" at once, if
+     * it has fallen behind), in one write.
+     */
+    start = alarm_now ();
+    end = start + seconds * NSEC_PER_SEC;
+    while ((now = alarm_now ()) < end) {
+        due = (long)((now - start) * rate / NSEC_PER_SEC);
+        if (due - sent > out_lines)
+            due = sent + out_lines;
+        p = out;
+        for (; sent < due; sent++) {
+            kind = gen_random () % 100;
+            pick = NULL;
+            if (kind < cancel_pct + replace_pct) {
+                /*
+                 * Find an alarm safely far from firing; drop the
+                 * ones that are too close as they are found.
+                 */
+                for (tries = 0; tries < 4 && live_count > 0; tries++) {
+                    i = gen_random () % live_count;
+                    if (live[i].deadline > now + SAFE_MARGIN) {
+                        pick = &live[i];
+                        break;
+                    }
+                    live[i] = live[--live_count];
+                }
+            }
+            interval = (delay_min + (int64_t)(gen_random () % (delay_max - delay_min + 1)))
+                * NSEC_PER_MSEC;
+            deadline = now + interval;
+            if (pick != NULL && kind < cancel_pct) {
+                p += sprintf (p, "Cancel: Message(%d)\n", pick->number);
+                *pick = live[--live_count];
+                cancels++;
+                continue;
+            }
+            if (pick != NULL) {
+                p += sprintf (p, "%lldms Message(%d) lg%ld@%lld\n",
+                    (long long)(interval / NSEC_PER_MSEC), pick->number, seq++,
+                    (long long)deadline);
+                pick->deadline = deadline;
+                replaces++;
+            } else {
+                p += sprintf (p, "%lldms Message(%ld) lg%ld@%lld\n",
+                    (long long)(interval / NSEC_PER_MSEC), next_number, seq++,
+                    (long long)deadline);
+                live[live_count].number = next_number++;
+                live[live_count++].deadline = deadline;
+                sets++;
+            }
+            if (deadline > last_deadline)
+                last_deadline = deadline;
+        }
+        if (p > out && write (to_child[1], out, p - out) != p - out)
+            errno_abort ("Write commands");
+        now = alarm_now ();
+        if (now + SEND_TICK < end) {
+            struct timespec pause = {0, SEND_TICK};
+            nanosleep (&pause, NULL);
+        }
+    }
+    elapsed = alarm_now () - start;
+
+    /*
+     * Wait for everything that should fire to fire (or for the
+     * grace period after the last deadline), then close the
+     * program's input so that it exits.
+     */
+    expected = sets - cancels;
+    status = pthread_mutex_lock (&gen_mutex);
+    if (status != 0)
+        err_abort (status, "Lock");
+    while (gen_fired < expected && alarm_now () < last_deadline + GRACE) {
+        struct timespec limit;
+
+        clock_gettime (CLOCK_REALTIME, &limit);
+        limit.tv_nsec += 100 * NSEC_PER_MSEC;
+        if (limit.tv_nsec >= NSEC_PER_SEC) {
+            limit.tv_sec++;
+            limit.tv_nsec -= NSEC_PER_SEC;
+        }
+        pthread_cond_timedwait (&gen_cond, &gen_mutex, &limit);
+    }
+    status = pthread_mutex_unlock (&gen_mutex);
+    if (status != 0)
+        err_abort (status, "Unlock");
+    close (to_child[1]);
+    waitpid (pid, &status, 0);
+    pthread_join (reader, NULL);
+
+    printf ("Sent %ld commands in %.2fs (%.0f/s): %ld sets, %ld replaces, %ld cancels\n",
+        sent, (double)elapsed / NSEC_PER_SEC, sent * (double)NSEC_PER_SEC / elapsed,
+        sets, replaces, cancels);
+    printf ("Acknowledged %ld requests, %ld replacements, %ld cancels\n",
+        gen_acks, gen_replaced, gen_cancelled);
+    printf ("Fired %ld of %ld alarms\n", gen_fired, expected);
+    if (gen_fired > 0) {
+        qsort (gen_lateness, gen_fired, sizeof (int64_t), compare);
+        printf ("Lateness: p50 %.3fms, p99 %.3fms, p99.9 %.3fms, max %.3fms\n",
+            (double)gen_lateness[gen_fired / 2] / NSEC_PER_MSEC,
+            (double)gen_lateness[(long)(gen_fired * 0.99)] / NSEC_PER_MSEC,
+            (double)gen_lateness[(long)(gen_fired * 0.999)] / NSEC_PER_MSEC,
+            (double)gen_lateness[gen_fired - 1] / NSEC_PER_MSEC);
+    }
+    return 0;
+}